@@ -5,14 +5,28 @@
 #define _GNU_SOURCE
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <termios.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <string.h>
 #include <time.h>
@@ -20,9 +34,37 @@
 ///// DEFINES /////
 
 #define CTRL_KEY(k) ((k) & 0x1f)
+#define TIMER_WHEEL_SLOTS 64
+#define SEARCH_MAX_THREADS 16
+#define OPENER_MAX_RESULTS 256
+#define BRACKET_TYPES 3 // (), [] and {}
+#define WORD_MAX_LENGTH 64 // Longer words are not offered for completion
+#define COMPLETE_MAX_CANDIDATES 8
 
 const int kTabStop = 4;
 const int kQuitTimes = 3;
+const int kRowChunkSize = 4096; // Rows longer than this are rendered by chunks
+const int kSnapshotBlockRows = 1024;
+const size_t kJournalFlushBytes = 16 * 1024;
+const int kJournalFlushMs = 1000;
+const int kTimerTickMs = 50;
+const int kStatusMsgMs = 5000;
+const int kFrameMs = 16; // Shortest interval between two paints
+const off_t kCacheMinSize = 1 << 20; // Smaller files load fast enough without a cache
+const size_t kCacheSample = 64 * 1024;
+const size_t kFollowChunk = 1 << 20;
+const size_t kFollowMaxRead = 16 << 20; // Per wakeup, so the screen keeps up
+const int kSearchMaxResults = 100000;
+const int kSearchTextMax = 256; // Bytes of the matching line kept for the list
+const size_t kSearchBinaryProbe = 8192; // A NUL byte in this prefix marks a binary file
+const int kSearchRefreshMs = 100;
+const size_t kSearchMapMin = 1 << 20; // Smaller files are read, saving the mmap and munmap calls
+const uint64_t kPathMaskUpper = 1ULL << 63;
+const int kBracketNone = INT_MAX / 4; // Minimum depth of a span without brackets
+const int kBracketLeafRows = 32; // Rows summarized by each leaf of the bracket tree
+const int kWordMinLength = 2;
+const int kPageBlockRows = 1024; // Rows paged out together, least recently used first
+const size_t kPageSaveBuffer = 1 << 20; // Paged saves stream through this many bytes
 
 enum editorKey {
     BACKSPACE = 127,
@@ -45,14 +87,85 @@ enum editorHighlight{
     HL_KEYWORD2,
     HL_STRING,
     HL_NUMBER,
-    HL_MATCH
+    HL_MATCH,
+    HL_SELECTION
+};
+
+// Subsystems whose heap usage is tracked
+enum editorMemKind {
+    MEM_CHARS = 0,
+    MEM_RENDER,
+    MEM_CHUNKS,
+    MEM_HIGHLIGHT,
+    MEM_ROWS,
+    MEM_APPEND,
+    MEM_SEARCH,
+    MEM_JOURNAL,
+    MEM_SNAPSHOT,
+    MEM_BRACKETS,
+    MEM_WORDS,
+    MEM_KINDS
+};
+
+enum editorJournalOp {
+    JOURNAL_INSERT_ROW = 1,
+    JOURNAL_DELETE_ROW,
+    JOURNAL_INSERT_CHAR,
+    JOURNAL_DELETE_CHAR,
+    JOURNAL_APPEND,
+    JOURNAL_TRUNCATE,
+    JOURNAL_SET_ROW
 };
 
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+enum editorLexerState {
+    LEX_SEPARATOR = 0,
+    LEX_WORD,
+    LEX_NUMBER,
+    LEX_STRING_DQ,
+    LEX_STRING_SQ,
+    LEX_ESCAPE_DQ,
+    LEX_ESCAPE_SQ,
+    LEX_MLCOMMENT,
+    LEX_COMMENT,
+    LEX_STATES
+};
+
+enum editorCharClass {
+    CC_WORD = 0,
+    CC_SEPARATOR,
+    CC_DIGIT,
+    CC_DOT,
+    CC_DQUOTE,
+    CC_SQUOTE,
+    CC_BACKSLASH,
+    CC_CLASSES
+};
+
+// Token kinds stored on lexer trie nodes, in priority order
+#define TOK_KEYWORD1 (1<<0)
+#define TOK_KEYWORD2 (1<<1)
+#define TOK_MLCOMMENT_END (1<<2)
+#define TOK_MLCOMMENT_START (1<<3)
+#define TOK_COMMENT (1<<4)
+
 ///// DATA /////
 
+// An editorSyntax compiled into character classes, a transition table and a token trie
+typedef struct editorLexer {
+    unsigned char charClass[256];
+    unsigned short table[LEX_STATES][CC_CLASSES]; // Next state | highlight << 8
+    unsigned char tokenFirst[256]; // Token kinds that may start with each byte
+    unsigned char trieClass[256]; // Bytes used by any token, numbered from 1
+    int trieWidth;
+    int maxToken; // Longest token, which bounds how far past a span lexing reads
+    size_t trieNodes;
+    uint32_t *trie; // trie[node * trieWidth + trieClass] -> child node
+    unsigned char *trieKinds;
+} editorLexer;
+
 struct editorSyntax{
     char *fileType;
     char **fileMatch;
@@ -61,18 +174,171 @@ struct editorSyntax{
     char *multiLineCommentStart;
     char *multiLineCommentEnd;
     int flags;
+    editorLexer *lexer;
 };
 
+typedef struct editorLexState {
+    unsigned char state;
+    unsigned char skip; // Chars already claimed by a token from the previous span
+    unsigned char skipHl;
+} editorLexState;
+
+typedef struct editorHlRun {
+    int start;
+    unsigned short length;
+    unsigned char hl;
+} editorHlRun;
+
+typedef struct editorHlBuilder {
+    editorHlRun *runs;
+    int count;
+    int capacity;
+} editorHlBuilder;
+
+// Header of a row payload. Payloads shared with a snapshot are never written
+// in place; the row copies its payload first.
+typedef struct editorText {
+    int refs;
+    char chars[];
+} editorText;
+
+#define TEXT_HEADER(p) ((editorText *)((p) - offsetof(editorText, chars)))
+
+// Nesting of the code brackets of a span of rows, per bracket type. Depths are
+// relative to the start of the span and taken right after each bracket.
+typedef struct editorBrackets {
+    int delta[BRACKET_TYPES];
+    int minDepth[BRACKET_TYPES]; // kBracketNone without brackets of the type
+} editorBrackets;
+
+typedef struct editorRowChunk {
+    int charStart;
+    int renderStart;
+    editorLexState state; // Entering the chunk
+    unsigned char plain; // As editorRow.plain, for the chunk alone
+    unsigned char tabs; // Holds a tab
+    unsigned char stale; // Text changed since state and brackets were taken
+    editorBrackets brackets;
+} editorRowChunk;
+
 typedef struct editorRow {
     int index;
     int size;
     int renderSize;
+    int plain; // No tabs or multi-byte chars, so render columns equal cursor columns
     char *chars;
     char *render;
-    unsigned char *highlighting;
+    int renderStart; // Render column of render[0]
+    int renderLength;
+    editorHlRun *hlRuns; // Cover render[0, renderLength)
+    int numHlRuns;
     int hlOpenComment;
+    int hlStale; // hlRuns not built yet; hlOpenComment is already valid, brackets too when 2
+    editorRowChunk *chunks;
+    int numChunks;
+    int windowFirst; // Chunks materialized in render
+    int windowLast;
+    editorBrackets brackets; // Outside strings and comments
+    int pageSpilled; // pageOffset is in the spill file rather than the opened file
+    off_t pageOffset; // Where a copy of chars is on disk, -1 once they change
 } editorRow;
 
+// Rows strictly between start and end are hidden behind row start
+typedef struct editorFold {
+    int start;
+    int end;
+} editorFold;
+
+typedef struct editorTimer {
+    long long expires; // Milliseconds on the monotonic clock
+    void (*callback)();
+    int pending;
+    struct editorTimer *next;
+} editorTimer;
+
+// Work done on the worker thread, then finished by done on the main thread
+typedef struct editorTask {
+    void (*run)(struct editorTask *task);
+    void (*done)(struct editorTask *task);
+    struct editorTask *next;
+} editorTask;
+
+typedef struct editorCursor {
+    int x;
+    int y;
+} editorCursor;
+
+typedef struct editorSnapshotLine {
+    char *chars; // NULL when the row was paged out
+    int size;
+    int spilled;
+    off_t offset; // Where to read a paged out row
+} editorSnapshotLine;
+
+// Rows of a snapshot, shared between snapshots that find them unchanged
+typedef struct editorSnapshotBlock {
+    int refs;
+    int numRows;
+    editorSnapshotLine lines[];
+} editorSnapshotBlock;
+
+// Immutable view of the buffer that a background thread can read while the
+// user keeps editing. References are only taken and dropped on the main thread.
+typedef struct editorSnapshot {
+    int refs;
+    unsigned long version;
+    int numRows;
+    int numBlocks;
+    editorSnapshotBlock **blocks;
+} editorSnapshot;
+
+// Replacement of chars[from, to) in row y, one per row in a batched edit
+typedef struct editorRowEdit {
+    int y;
+    int from;
+    int to;
+} editorRowEdit;
+
+// One path waiting to be visited, on the queue of a crawl thread
+typedef struct editorCrawlItem {
+    char *path;
+    int isDir;
+} editorCrawlItem;
+
+// Owner pushes and pops at the tail, other threads steal from the head
+typedef struct editorCrawlQueue {
+    pthread_mutex_t lock;
+    struct editorCrawl *crawl;
+    editorCrawlItem *items;
+    int head;
+    int tail;
+    int capacity;
+} editorCrawlQueue;
+
+// Directory walk shared by a pool of work-stealing threads
+typedef struct editorCrawl {
+    int numThreads;
+    pthread_t threads[SEARCH_MAX_THREADS];
+    editorCrawlQueue queues[SEARCH_MAX_THREADS];
+    int outstanding; // Items queued or being visited, updated atomically
+    int cancel;
+    // Threads with nothing to do wait on idleCond until pushes changes or
+    // outstanding drops to 0
+    pthread_mutex_t idleLock;
+    pthread_cond_t idleCond;
+    long pushes;
+    int idle;
+    // Called for each item; directories must queue their own entries
+    void (*visit)(struct editorCrawl *crawl, int q, editorCrawlItem *item, char *buffer);
+} editorCrawl;
+
+typedef struct editorSearchResult {
+    char *path;
+    int line;
+    int col; // Byte offset of the match in the line
+    char *text;
+} editorSearchResult;
+
 struct editorConfig {
     int cursorX;
     int cursorY;
@@ -83,15 +349,217 @@ struct editorConfig {
     int screenCols;
     int numRows;
     editorRow *rows;
+    int rowsCapacity;
     int dirtyFlag;
+    unsigned long version; // Bumped by every row primitive
+    editorSnapshot *snapshot; // Latest snapshot still referenced, if any
     char *filename;
+    int fileTrailingNewline;
+    off_t fileSize; // Last known state of the file on disk
+    struct timespec fileMtime;
+    ino_t fileInode;
+    int watchFd;
+    int watchWd;
+    int journalFd;
+    int journalPaused;
+    char *journalBuffer; // Records not yet written
+    size_t journalLength;
+    size_t journalCapacity;
+    editorTimer journalTimer;
+    int journalFailed; // The last flush couldn't write everything
+    int saving; // A save is running on the worker thread
+    int headless; // No terminal, watch or journal, as in --mem-report
+    int followFd; // Read-only tail of the file, -1 when not following
+    ino_t followInode;
+    off_t followOffset;
+    editorTimer followTimer;
+    int searchMatchRow; // Drawn over the highlighting as HL_MATCH
+    int searchMatchX;
+    int searchMatchLength;
+    editorCursor *cursors; // Extra cursors besides cursorX/cursorY
+    int numCursors;
+    int blockActive; // Rectangle from the anchor to the cursor
+    int blockAnchorX; // Render column
+    int blockAnchorY;
+    int listActive; // A list is drawn instead of the rows
+    int listCount;
+    int listSelected;
+    int listOffset;
+    int (*listLine)(int index, char *buf, int size);
+    editorFold *folds; // Sorted and disjoint
+    int numFolds;
     char statusMsg[80];
     time_t statusMsgTime;
+    editorTimer statusMsgTimer;
     struct editorSyntax *syntax;
     struct termios original_termios;
 };
 struct editorConfig EditorConfig;
 
+struct editorEvents {
+    int epollFd;
+    int signalFd; // SIGWINCH
+    int taskFd; // eventfd counting finished tasks
+    int watchFd; // inotify fd registered with epoll
+    int redraw;
+    editorTimer *wheel[TIMER_WHEEL_SLOTS];
+    long long wheelTick; // Last tick walked
+    int numTimers;
+    pthread_t worker;
+    int workerStarted;
+    pthread_mutex_t lock; // Guards queue and finished
+    pthread_cond_t wake;
+    editorTask *queue;
+    editorTask *finished;
+    int pendingTasks;
+    editorTimer frameTimer; // Paints a frame deferred by the frame cap
+    long long lastFrame;
+    long long paintMs; // Duration of the last paint, including the write
+    long long framesPainted;
+    long long framesSkipped; // Keys that never got a frame of their own
+    long long keysProcessed;
+    int keysSinceFrame;
+};
+struct editorEvents EditorEvents;
+
+// Segment tree over the bracket summaries of the rows, leaf i at size + i.
+// Leaves hold runs of about kBracketLeafRows rows, counted in rows[], so
+// inserting or deleting a row only updates the path of its leaf. A leaf is
+// split when it doubles and merged with a neighbour when it halves.
+struct editorBracketTree {
+    editorBrackets *nodes;
+    int *rows; // Rows under each node
+    int size;
+    int leaves; // Leaves holding rows; those past them are empty
+    int valid;
+};
+struct editorBracketTree BracketTree;
+
+// Trie of the words in the buffer with their number of occurrences
+typedef struct editorWordNode {
+    int child; // First child; siblings are sorted by c
+    int sibling;
+    int count; // Occurrences of the word ending here
+    unsigned char c;
+} editorWordNode;
+
+typedef struct editorWordSpan {
+    int start;
+    int length;
+} editorWordSpan;
+
+struct editorWordIndex {
+    int built; // Filled on first use, then kept current as rows change
+    editorWordNode *nodes; // nodes[0] is the root
+    int numNodes;
+    int nodesCapacity;
+    editorWordSpan *oldWords; // Scratch for the words of a row before and after an edit
+    int oldCapacity;
+    editorWordSpan *newWords;
+    int newCapacity;
+    char candidates[COMPLETE_MAX_CANDIDATES][WORD_MAX_LENGTH + 1]; // Most frequent first
+    int candidateCounts[COMPLETE_MAX_CANDIDATES];
+    int numCandidates;
+    int prefixLength;
+    int cycling; // Ctrl-N was the last key; pressing it again takes the next candidate
+    int selected;
+    int inserted; // Bytes of the selected candidate typed after the prefix
+    int hintShown; // The message bar lists candidates
+};
+struct editorWordIndex WordIndex;
+
+struct editorProjectSearch {
+    editorTask task; // Finished once every search thread has exited
+    int running;
+    int listOpen;
+    char *query;
+    int queryLength;
+    editorCrawl crawl;
+    long long filesSearched;
+    long long bytesSearched;
+    long long started;
+    long long elapsed; // Milliseconds, once finished
+    pthread_mutex_t lock; // Guards results
+    editorSearchResult *results;
+    int numResults;
+    int resultsCapacity;
+    int truncated;
+    editorTimer timer; // Refreshes the list while results stream in
+};
+struct editorProjectSearch ProjectSearch;
+
+// Entries of one directory as last listed
+typedef struct editorIndexDir {
+    char *path;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    char *names; // A type byte ('d' or 'f') and a NUL-terminated name per entry
+    int namesLength;
+} editorIndexDir;
+
+// Every file path in one block, scanned on each keystroke of the opener
+typedef struct editorPathIndex {
+    char *paths;
+    uint32_t *offsets;
+    uint64_t *masks; // Characters present in each path, for a quick reject
+    int numPaths;
+    size_t length;
+} editorPathIndex;
+
+struct editorFileIndex {
+    editorTask loadTask; // Reads the persisted index
+    editorTask task; // Refreshes the index from the tree
+    editorCrawl crawl;
+    int loaded;
+    int running;
+    pthread_mutex_t lock; // Guards dirs during a crawl
+    editorIndexDir *dirs; // Being listed by the crawl
+    int numDirs;
+    int dirsCapacity;
+    editorIndexDir *known; // Last complete crawl, sorted by path
+    int numKnown;
+    editorPathIndex index;
+    editorPathIndex next; // Built by the crawl, swapped in when done
+    int *candidates; // Paths matching query, narrowed as it grows
+    int candidatesCapacity;
+    int numCandidates; // -1 when they need a full scan
+    char *query; // Lowercased
+    int matches[OPENER_MAX_RESULTS];
+    int scores[OPENER_MAX_RESULTS];
+    int numMatches;
+    char *chosen;
+    unsigned char lower[256];
+    unsigned char wordStart[256]; // Bytes after which a word starts
+};
+struct editorFileIndex FileIndex;
+
+struct editorMemory {
+    size_t bytes[MEM_KINDS]; // As reported by malloc_usable_size
+    size_t peak[MEM_KINDS];
+    long blocks[MEM_KINDS];
+};
+struct editorMemory EditorMemory;
+
+// Row payloads beyond the budget are paged out by blocks of kPageBlockRows,
+// least recently used first, and read back from the opened file or from a
+// spill file holding the rows changed since
+struct editorPaging {
+    size_t budget; // Bytes of chars, render, chunks and highlighting; 0 keeps every row
+    int sourceFd; // The file as opened, still readable after a save renames over it
+    int sourceLost; // Rewritten in place while rows were paged out from it
+    int spillFd; // Unlinked, created on the first spill
+    off_t spillSize;
+    long long *lastUse; // Per block, 0 while it is not tracked
+    int numBlocks;
+    int *loaded; // Tracked blocks, which may hold loaded rows
+    int numLoaded;
+    int loadedCapacity;
+    long long tick;
+    long long faults;
+    long long evictions;
+};
+struct editorPaging Paging;
+
 ///// FILETYPES /////
 
 char *HLCExtensions[] = { ".c", ".h", ".cpp", NULL };
@@ -108,12 +576,17 @@ struct editorSyntax HLDB[] = {
         HLCExtensions,
         HLCkeywords,
         "//", "/*", "*/",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        NULL
     },
 };
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
+// Definitions loaded from the user's syntax file, checked before HLDB
+struct editorSyntax *LoadedSyntax = NULL;
+unsigned int LoadedSyntaxEntries = 0;
+
 ///// PROTOTYPES /////
 
 void editorSetStatusMessage(const char *fmt, ...);
@@ -122,9 +595,78 @@ void editorRefreshScreen();
 
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
 
+int editorCheckFileChanges();
+
+void editorWatchFile();
+
+void editorRecordFileState();
+
+void editorJournalRecord(int op, int a, int b, const char *s, size_t len);
+
+void editorJournalFlush();
+
+void editorWaitForInput();
+
+void editorRequestFrame();
+
+int getWindowSize(int *rows, int *cols);
+
+void editorJournalClose(int keep);
+
+void editorJournalReset();
+
+void editorJournalRebase(off_t offset);
+
+void editorFollowRead();
+
+void editorFollowIngest();
+
+void editorJournalOpen();
+
+void editorRowTruncate(editorRow *row, int size);
+
+void editorMoveCursor(int key);
+
+int editorRowChunkEnd(editorRow *row, int k);
+
+int editorReadKey();
+
+int editorListMove(int key);
+
+int editorOpenAt(char *fileName, int line, int col);
+
+void editorFollowStop();
+
+int editorOpenerLine(int index, char *buf, int size);
+
+void editorIndexMatch(const char *query);
+
+void editorBracketTreeUpdate(int index);
+
+void editorBracketsCombine(editorBrackets *out, const editorBrackets *left, const editorBrackets *right);
+
+void editorWordsUpdate(editorRow *row);
+
+void editorWordsRemoveRow(editorRow *row);
+
+void editorWordsClear();
+
+void editorRowLoad(editorRow *row);
+
+int editorRowPeek(editorRow *row);
+
+int editorRowEvict(editorRow *row);
+
+void editorPageTouch(int y);
+
+void editorPageShift(int pos, int delta);
+
+void editorPageTrim();
+
 ///// TERMINAL /////
 
 void die(const char *s){
+    editorJournalClose(1);
     write(STDOUT_FILENO, "\x1b[2J", 4);
     write(STDOUT_FILENO, "\x1b[H", 3);
     perror(s);
@@ -155,8 +697,11 @@ void enableRawMode(){
 int editorReadKey() {
     char c;
     int nread;
+    editorWaitForInput();
     while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
         if (nread == -1 && errno != EAGAIN) die("read");
+        if (nread == 0)
+            editorWaitForInput();
     }
     
     if (c == '\x1b') {
@@ -203,7 +748,7 @@ int editorReadKey() {
         return '\x1b';
     } 
     else
-        return c;
+        return (unsigned char)c;
 }
 
 int getCursorPosition(int *rows, int *cols) {
@@ -240,486 +785,5398 @@ int getWindowSize(int *rows, int *cols) {
     }
 }
 
-///// SYNTAX HIGHLIGHTING /////
+///// MEMORY /////
 
-int isSeparator(int c) {
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+const char *kMemKindNames[MEM_KINDS] = {
+    "chars", "render", "chunk tables", "highlighting", "rows array", "append buffer", "search", "journal", "snapshots", "bracket index", "word index"
+};
+
+// realloc that keeps the byte and block counts of kind up to date. Search
+// threads allocate too, so the counts are updated atomically.
+void *editorRealloc(int kind, void *ptr, size_t size){
+    size_t old = ptr ? malloc_usable_size(ptr) : 0;
+    void *new = realloc(ptr, size);
+    if(new == NULL && size)
+        return NULL;
+    __atomic_add_fetch(&EditorMemory.bytes[kind], new ? malloc_usable_size(new) : 0, __ATOMIC_RELAXED);
+    size_t bytes = __atomic_sub_fetch(&EditorMemory.bytes[kind], old, __ATOMIC_RELAXED);
+    if(bytes > EditorMemory.peak[kind])
+        EditorMemory.peak[kind] = bytes;
+    __atomic_add_fetch(&EditorMemory.blocks[kind], (new != NULL) - (ptr != NULL), __ATOMIC_RELAXED);
+    return new;
 }
 
-void editorUpdateSyntax(editorRow *row){
-    row->highlighting = realloc(row->highlighting, row->renderSize);
-    memset(row->highlighting, HL_NORMAL, row->renderSize);
-    
-    if(EditorConfig.syntax == NULL)
+void *editorMalloc(int kind, size_t size){
+    return editorRealloc(kind, NULL, size);
+}
+
+void editorFree(int kind, void *ptr){
+    if(ptr == NULL)
         return;
-    
-    char **keywords = EditorConfig.syntax->keywords;
-    
-    char *scs = EditorConfig.syntax->singleLineCommentStart;
-    char *mcs = EditorConfig.syntax->multiLineCommentStart;
-    char *mce = EditorConfig.syntax->multiLineCommentEnd;
-    int scsLength = scs ? strlen(scs) : 0;
-    int mcsLength = mcs ? strlen(mcs) : 0;
-    int mceLength = mce ? strlen(mce) : 0;
-    
-    int prevSep = 1;
-    int inString = 0;
-    int inComment = row->index > 0 && EditorConfig.rows[row->index - 1].hlOpenComment;
-    
-    int i = 0;
-    while(i < row->renderSize){
-        char c = row->render[i];
-        unsigned char prevHl = (i > 0) ? row->highlighting[i - 1] : HL_NORMAL;
-        
-        if(scsLength && !inString && !inComment){
-            if(!strncmp(&row->render[i], scs, scsLength)){
-                memset(&row->highlighting[i], HL_COMMENT, row->renderSize - i);
-                break;
-            }
-        }
-        
-        if (mcsLength && mceLength && !inString) {
-            if (inComment) {
-                row->highlighting[i] = HL_MLCOMMENT;
-                if (!strncmp(&row->render[i], mce, mceLength)) {
-                    memset(&row->highlighting[i], HL_MLCOMMENT, mceLength);
-                    i += mceLength;
-                    inComment = 0;
-                    prevSep = 1;
-                    continue;
-                }
-                else {
-                    i++;
-                    continue;
-                }
-            } 
-            else if (!strncmp(&row->render[i], mcs, mcsLength)) {
-                memset(&row->highlighting[i], HL_MLCOMMENT, mcsLength);
-                i += mcsLength;
-                inComment = 1;
-                continue;
-            }
-        }
-        
-        if(EditorConfig.syntax->flags & HL_HIGHLIGHT_STRINGS){
-            if(inString){
-                row->highlighting[i] = HL_STRING;
-                if(c == '\\' && i + 1 < row->renderSize){
-                    row->highlighting[i + 1] = HL_STRING;
-                    i += 2;
-                    continue;
-                }
-                if(c == inString)
-                    inString = 0;
-                i++;
-                prevSep = 1;
-                continue;
-            }
-            else{
-                if(c == '"' || c == '\''){
-                    inString = c;
-                    row->highlighting[i] = HL_STRING;
-                    i++;
-                    continue;
-                }
-            }
-        }
-        
-        if(EditorConfig.syntax->flags & HL_HIGHLIGHT_NUMBERS){
-            if((isdigit(c) && (prevSep || prevHl == HL_NUMBER)) || (c == '.' && prevHl == HL_NUMBER)){
-                row->highlighting[i] = HL_NUMBER;
-                i++;
-                prevSep = 0;
-                continue;
-            }
-        }
-        
-        if (prevSep) {
-            int j;
-            for (j = 0; keywords[j]; j++) {
-                int kwLength = strlen(keywords[j]);
-                int kw2 = keywords[j][kwLength - 1] == '|';
-                if (kw2) 
-                    kwLength--;
-                if (!strncmp(&row->render[i], keywords[j], kwLength) && isSeparator(row->render[i + kwLength])) {
-                    memset(&row->highlighting[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, kwLength);
-                    i += kwLength;
-                    break;
-                }
-            }
-            if (keywords[j] != NULL) {
-                prevSep = 0;
-                continue;
-            }
-        }
-        
-        prevSep = isSeparator(c);
-        i++;
-    }
-    
-    // Update after starting multi-line comment
-    int changed = row->hlOpenComment != inComment;
-    row->hlOpenComment = inComment;
-    if(changed && row->index + 1 < EditorConfig.numRows)
-        editorUpdateSyntax(&EditorConfig.rows[row->index + 1]);
+    __atomic_sub_fetch(&EditorMemory.bytes[kind], malloc_usable_size(ptr), __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&EditorMemory.blocks[kind], 1, __ATOMIC_RELAXED);
+    free(ptr);
 }
 
-int editorSyntaxToColor(int hl){
-    switch(hl){
-        case HL_COMMENT:
-        case HL_MLCOMMENT: return 32;
-        case HL_KEYWORD1: return 33;
-        case HL_KEYWORD2: return 36;
-        case HL_STRING: return 31;
-        case HL_NUMBER: return 35;
-        case HL_MATCH: return 34;
-        default: return 37;
+// Payloads are only referenced and released on the main thread, so the counts
+// need no atomics; background readers just read the bytes.
+char *editorCharsAlloc(size_t size){
+    editorText *text = editorMalloc(MEM_CHARS, offsetof(editorText, chars) + size);
+    text->refs = 1;
+    return text->chars;
+}
+
+char *editorCharsShare(char *chars){
+    TEXT_HEADER(chars)->refs++;
+    return chars;
+}
+
+void editorCharsRelease(char *chars){
+    if(chars == NULL)
+        return;
+    editorText *text = TEXT_HEADER(chars);
+    if(--text->refs == 0)
+        editorFree(MEM_CHARS, text);
+}
+
+// Resizes a payload keeping its first used bytes, copying it if shared
+char *editorCharsResize(char *chars, size_t size, size_t used){
+    editorText *text = TEXT_HEADER(chars);
+    if(text->refs > 1){
+        char *copy = editorCharsAlloc(size);
+        memcpy(copy, chars, used < size ? used : size);
+        text->refs--;
+        return copy;
     }
+    text = editorRealloc(MEM_CHARS, text, offsetof(editorText, chars) + size);
+    return text->chars;
 }
 
-void editorSelectSyntaxHighlight(){
-    EditorConfig.syntax = NULL;
-    if(EditorConfig.filename == NULL)
+size_t editorMemTracked(){
+    size_t total = 0;
+    for(int k = 0; k < MEM_KINDS; k++)
+        total += EditorMemory.bytes[k];
+    return total;
+}
+
+// Heap in use that no subsystem accounts for
+size_t editorMemUntracked(){
+    struct mallinfo2 info = mallinfo2();
+    size_t used = info.uordblks + info.hblkhd; // Arena and mmapped chunks
+    size_t tracked = editorMemTracked();
+    return used > tracked ? used - tracked : 0;
+}
+
+// Tracked bytes per row beyond the text itself. Only the text of rows in
+// memory counts, as paged out rows hold none.
+// Bytes of text held in memory; rows paged out don't count
+size_t editorMemResidentText(){
+    size_t text = 0;
+    for(int j = 0; j < EditorConfig.numRows; j++)
+        if(EditorConfig.rows[j].chars)
+            text += EditorConfig.rows[j].size;
+    return text;
+}
+
+double editorMemOverheadPerLine(){
+    if(EditorConfig.numRows == 0)
+        return 0;
+    size_t text = editorMemResidentText();
+    size_t tracked = editorMemTracked();
+    return (double)(tracked > text ? tracked - text : 0) / EditorConfig.numRows;
+}
+
+void editorFormatBytes(char *buf, size_t size, size_t bytes){
+    if(bytes >= 10 * 1024 * 1024)
+        snprintf(buf, size, "%zuM", bytes >> 20);
+    else if(bytes >= 10 * 1024)
+        snprintf(buf, size, "%zuK", bytes >> 10);
+    else
+        snprintf(buf, size, "%zu", bytes);
+}
+
+///// EVENT LOOP /////
+
+long long editorNow(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void editorTimerCancel(editorTimer *timer){
+    if(!timer->pending)
         return;
+    editorTimer **link = &EditorEvents.wheel[(timer->expires / kTimerTickMs) % TIMER_WHEEL_SLOTS];
+    while(*link != timer)
+        link = &(*link)->next;
+    *link = timer->next;
+    timer->pending = 0;
+    EditorEvents.numTimers--;
+}
+
+// Timers hash into the wheel by their expiry tick; later rounds share a slot
+void editorTimerSchedule(editorTimer *timer, int ms){
+    editorTimerCancel(timer);
+    timer->expires = editorNow() + ms;
+    editorTimer **slot = &EditorEvents.wheel[(timer->expires / kTimerTickMs) % TIMER_WHEEL_SLOTS];
+    timer->next = *slot;
+    *slot = timer;
+    timer->pending = 1;
+    EditorEvents.numTimers++;
+}
+
+// Fires the timers due in the slots passed since the last call
+void editorTimerExpire(){
+    long long now = editorNow();
+    long long tick = now / kTimerTickMs;
+    long long first = EditorEvents.wheelTick;
+    if(first == 0 || tick - first >= TIMER_WHEEL_SLOTS)
+        first = tick - TIMER_WHEEL_SLOTS + 1;
+    // The current slot is walked again next time, as it may hold timers due later in this tick
+    EditorEvents.wheelTick = tick;
     
-    char *ext = strrchr(EditorConfig.filename, '.');
-    
-    for(unsigned int j = 0; j < HLDB_ENTRIES; j++){
-        struct editorSyntax *s = &HLDB[j];
-        unsigned int i = 0;
-        while(s->fileMatch[i]){
-            int isExt = (s->fileMatch[i][0] == '.');
-            if ((isExt && ext && !strcmp(ext, s->fileMatch[i])) ||
-                (!isExt && strstr(EditorConfig.filename, s->fileMatch[i]))) {
-                EditorConfig.syntax = s;
-                
-                for(int fileRow = 0; fileRow < EditorConfig.numRows; fileRow++)
-                    editorUpdateSyntax(&EditorConfig.rows[fileRow]);
-                
-                return;
+    for(long long t = first; t <= tick; t++){
+        editorTimer **link = &EditorEvents.wheel[t % TIMER_WHEEL_SLOTS];
+        while(*link){
+            editorTimer *timer = *link;
+            if(timer->expires > now){
+                link = &timer->next;
+                continue;
             }
-            i++;
+            *link = timer->next;
+            timer->pending = 0;
+            EditorEvents.numTimers--;
+            timer->callback();
         }
     }
 }
 
-///// ROW OPERATIONS /////
+// Milliseconds until the next timer is due, or -1 to sleep until an event
+int editorTimerTimeout(){
+    if(EditorEvents.numTimers == 0)
+        return -1;
+    long long next = -1;
+    for(int s = 0; s < TIMER_WHEEL_SLOTS; s++)
+        for(editorTimer *timer = EditorEvents.wheel[s]; timer; timer = timer->next)
+            if(next == -1 || timer->expires < next)
+                next = timer->expires;
+    long long wait = next - editorNow();
+    return wait < 0 ? 0 : wait;
+}
 
-int editorRowCursorToRender(editorRow *row, int cursorX){
-    int renderX = 0;
-    for (int j = 0; j < cursorX; j++) {
-        if (row->chars[j] == '\t')
-            renderX += (kTabStop - 1) - (renderX % kTabStop);
-        renderX++;
+// Hands a task to the event loop; called with EditorEvents.lock held
+void editorTaskFinished(editorTask *task){
+    task->next = EditorEvents.finished;
+    EditorEvents.finished = task;
+    uint64_t one = 1;
+    write(EditorEvents.taskFd, &one, sizeof(one));
+}
+
+void *editorWorker(void *arg){
+    (void)arg;
+    pthread_mutex_lock(&EditorEvents.lock);
+    while(1){
+        while(EditorEvents.queue == NULL)
+            pthread_cond_wait(&EditorEvents.wake, &EditorEvents.lock);
+        editorTask *task = EditorEvents.queue;
+        EditorEvents.queue = task->next;
+        pthread_mutex_unlock(&EditorEvents.lock);
+        
+        task->run(task);
+        
+        pthread_mutex_lock(&EditorEvents.lock);
+        editorTaskFinished(task);
     }
-    return renderX;
+    return NULL;
+}
 
-    // TODO
-    /*
-        int lastTab = -1;
-        for (int j = 0; j < cursorX; j++)
-            if (row->chars[j] == '\t')
-                lastTab = j;
-        if(lastTab != -1 && cursorX - lastTab < kTabStop)
-            return lastTab + kTabStop;
-        return cursorX; 
-    */
+// Runs a long task on a thread of its own so it doesn't hold up the worker
+void *editorTaskThread(void *arg){
+    editorTask *task = arg;
+    task->run(task);
+    pthread_mutex_lock(&EditorEvents.lock);
+    editorTaskFinished(task);
+    pthread_mutex_unlock(&EditorEvents.lock);
+    return NULL;
 }
 
-int editorRowRenderToCursor(editorRow *row, int renderX){
-    int currentRenderX = 0;
-    int cursorX;
-    for (cursorX = 0; cursorX < row->size; cursorX++) {
-        if (row->chars[cursorX] == '\t')
-            currentRenderX += (kTabStop - 1) - (currentRenderX % kTabStop);
-        currentRenderX++;
-        if (currentRenderX > renderX) 
-            return cursorX;
-    }
-    return cursorX;
+void editorSpawnTask(editorTask *task){
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, editorTaskThread, task) != 0)
+        die("pthread_create");
+    pthread_detach(thread);
+    EditorEvents.pendingTasks++;
 }
 
-void editorUpdateRow(editorRow *row){
-    int tabs = 0;
-    int j;
-    for(j = 0; j < row->size; j++)
-        if(row->chars[j] == '\t') 
-            tabs++;
-        
-    free(row->render);
-    row->render = malloc(row->size + tabs * (kTabStop - 1) + 1);
-    
-    int idx = 0;
-    for (j = 0; j < row->size; j++){
-        if(row->chars[j] == '\t')
-            do row->render[idx++] = ' ';
-            while(idx % kTabStop != 0);
-        else
-            row->render[idx++] = row->chars[j];
+// Queues a task for the worker thread; its done callback runs in the event loop
+void editorSubmitTask(editorTask *task){
+    if(!EditorEvents.workerStarted){
+        if(pthread_create(&EditorEvents.worker, NULL, editorWorker, NULL) != 0)
+            die("pthread_create");
+        pthread_detach(EditorEvents.worker);
+        EditorEvents.workerStarted = 1;
     }
-    row->render[idx] = '\0';
-    row->renderSize = idx;
     
-    editorUpdateSyntax(row);
+    task->next = NULL;
+    pthread_mutex_lock(&EditorEvents.lock);
+    editorTask **tail = &EditorEvents.queue;
+    while(*tail)
+        tail = &(*tail)->next;
+    *tail = task;
+    pthread_cond_signal(&EditorEvents.wake);
+    pthread_mutex_unlock(&EditorEvents.lock);
+    EditorEvents.pendingTasks++;
 }
 
-void editorInsertRow(int pos, char *s, size_t len){
-    if(pos < 0 || pos > EditorConfig.numRows)
-        return;
-    
-    EditorConfig.rows = realloc(EditorConfig.rows, sizeof(editorRow) * (EditorConfig.numRows + 1));
-    memmove(&EditorConfig.rows[pos + 1], &EditorConfig.rows[pos], sizeof(editorRow) * (EditorConfig.numRows - pos));
-    for(int j = pos + 1; j <= EditorConfig.numRows; j++)
-        EditorConfig.rows[j].index++;
+void editorFinishTasks(){
+    uint64_t count;
+    read(EditorEvents.taskFd, &count, sizeof(count));
     
-    EditorConfig.rows[pos].index = pos;
+    pthread_mutex_lock(&EditorEvents.lock);
+    editorTask *finished = EditorEvents.finished;
+    EditorEvents.finished = NULL;
+    pthread_mutex_unlock(&EditorEvents.lock);
     
-    EditorConfig.rows[pos].size = len;
-    EditorConfig.rows[pos].chars = malloc(len + 1);
-    memcpy(EditorConfig.rows[pos].chars, s, len);
-    EditorConfig.rows[pos].chars[len] = '\0';
-    
-    EditorConfig.rows[pos].renderSize = 0;
-    EditorConfig.rows[pos].render = NULL;
-    EditorConfig.rows[pos].highlighting = NULL;
-    EditorConfig.rows[pos].hlOpenComment = 0;
-    editorUpdateRow(&EditorConfig.rows[pos]);
-    
-    EditorConfig.numRows++;
-    EditorConfig.dirtyFlag++;
+    // Finished tasks are pushed in reverse order
+    editorTask *ordered = NULL;
+    while(finished){
+        editorTask *next = finished->next;
+        finished->next = ordered;
+        ordered = finished;
+        finished = next;
+    }
+    while(ordered){
+        editorTask *next = ordered->next;
+        EditorEvents.pendingTasks--;
+        ordered->done(ordered);
+        ordered = next;
+    }
+    EditorEvents.redraw = 1;
 }
 
-void editorRowInsertChar(editorRow *row, int pos, int c){
-    if(pos < 0 || pos > row->size)
-        pos = row->size;
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[pos + 1], &row->chars[pos], row->size - pos + 1);
-    row->size++;
-    row->chars[pos] = c;
-    editorUpdateRow(row);
-    EditorConfig.dirtyFlag++;
+// Blocks until the save in progress, if any, has finished
+void editorWaitSave(){
+    while(EditorConfig.saving){
+        struct pollfd pfd = {EditorEvents.taskFd, POLLIN, 0};
+        if(poll(&pfd, 1, -1) == -1 && errno != EINTR)
+            die("poll");
+        editorFinishTasks();
+    }
 }
 
-void editorRowDelChar(editorRow *row, int pos){
+// Blocks until every submitted task has finished
+void editorWaitTasks(){
+    while(EditorEvents.pendingTasks > 0){
+        struct pollfd pfd = {EditorEvents.taskFd, POLLIN, 0};
+        if(poll(&pfd, 1, -1) == -1 && errno != EINTR)
+            die("poll");
+        editorFinishTasks();
+    }
+}
+
+void editorResize(){
+    struct signalfd_siginfo info;
+    while(read(EditorEvents.signalFd, &info, sizeof(info)) > 0)
+        ;
+    if(getWindowSize(&EditorConfig.screenRows, &EditorConfig.screenCols) == -1)
+        die("getWindowSize");
+    EditorConfig.screenRows -= 2; // Status
+    EditorEvents.redraw = 1;
+}
+
+// Services timers, resizes, file changes and finished tasks until a key can be read
+void editorWaitForInput(){
+    while(1){
+        editorTimerExpire();
+        if(EditorEvents.redraw){
+            EditorEvents.redraw = 0;
+            editorRefreshScreen();
+        }
+        
+        if(EditorConfig.watchFd != EditorEvents.watchFd){
+            struct epoll_event event = {.events = EPOLLIN, .data.fd = EditorConfig.watchFd};
+            epoll_ctl(EditorEvents.epollFd, EPOLL_CTL_ADD, EditorConfig.watchFd, &event);
+            EditorEvents.watchFd = EditorConfig.watchFd;
+        }
+        
+        struct epoll_event events[8];
+        int n = epoll_wait(EditorEvents.epollFd, events, 8, editorTimerTimeout());
+        if(n == -1 && errno != EINTR)
+            die("epoll_wait");
+        
+        int input = 0;
+        for(int i = 0; i < n; i++){
+            int fd = events[i].data.fd;
+            if(fd == STDIN_FILENO)
+                input = 1;
+            else if(fd == EditorEvents.signalFd)
+                editorResize();
+            else if(fd == EditorEvents.taskFd)
+                editorFinishTasks();
+            else if(fd == EditorConfig.watchFd && editorCheckFileChanges())
+                editorRequestFrame();
+        }
+        if(input)
+            return;
+    }
+}
+
+int editorInputPending(){
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    return poll(&pfd, 1, 0) > 0;
+}
+
+void editorFrameDue(){
+    EditorEvents.redraw = 1;
+}
+
+// Paints now, or once the frame interval has passed. The interval grows to
+// the time the last paint took, which is bounded by how fast the terminal reads.
+void editorRequestFrame(){
+    long long interval = EditorEvents.paintMs > kFrameMs ? EditorEvents.paintMs : kFrameMs;
+    long long wait = EditorEvents.lastFrame + interval - editorNow();
+    if(wait <= 0){
+        editorTimerCancel(&EditorEvents.frameTimer);
+        editorRefreshScreen();
+    }
+    else if(!EditorEvents.frameTimer.pending)
+        editorTimerSchedule(&EditorEvents.frameTimer, wait);
+}
+
+void editorInitEvents(){
+    // Resizes are read from a signalfd, so the signal stays blocked in every thread
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGWINCH);
+    if(pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0)
+        die("pthread_sigmask");
+    
+    EditorEvents.epollFd = epoll_create1(EPOLL_CLOEXEC);
+    EditorEvents.signalFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    EditorEvents.taskFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(EditorEvents.epollFd == -1 || EditorEvents.signalFd == -1 || EditorEvents.taskFd == -1)
+        die("editorInitEvents");
+    
+    int fds[] = {STDIN_FILENO, EditorEvents.signalFd, EditorEvents.taskFd};
+    for(unsigned int i = 0; i < sizeof(fds) / sizeof(fds[0]); i++){
+        struct epoll_event event = {.events = EPOLLIN, .data.fd = fds[i]};
+        if(epoll_ctl(EditorEvents.epollFd, EPOLL_CTL_ADD, fds[i], &event) == -1)
+            die("epoll_ctl");
+    }
+    
+    EditorEvents.watchFd = -1;
+    EditorEvents.redraw = 0;
+    memset(EditorEvents.wheel, 0, sizeof(EditorEvents.wheel));
+    EditorEvents.wheelTick = 0;
+    EditorEvents.numTimers = 0;
+    EditorEvents.workerStarted = 0;
+    pthread_mutex_init(&EditorEvents.lock, NULL);
+    pthread_cond_init(&EditorEvents.wake, NULL);
+    EditorEvents.queue = NULL;
+    EditorEvents.finished = NULL;
+    EditorEvents.pendingTasks = 0;
+    EditorEvents.frameTimer.callback = editorFrameDue;
+    EditorEvents.frameTimer.pending = 0;
+    EditorEvents.lastFrame = 0;
+    EditorEvents.paintMs = 0;
+    EditorEvents.framesPainted = 0;
+    EditorEvents.framesSkipped = 0;
+    EditorEvents.keysProcessed = 0;
+    EditorEvents.keysSinceFrame = 0;
+}
+
+///// UNICODE /////
+
+typedef struct editorWidthRange {
+    int first;
+    int last;
+    int width;
+} editorWidthRange;
+
+// Zero-width (combining) and double-width (East Asian wide) code points
+const editorWidthRange kWidthRanges[] = {
+    { 0x0300, 0x036F, 0 }, { 0x0483, 0x0489, 0 }, { 0x0591, 0x05BD, 0 },
+    { 0x05BF, 0x05C7, 0 }, { 0x0610, 0x061A, 0 }, { 0x064B, 0x065F, 0 },
+    { 0x0670, 0x0670, 0 }, { 0x06D6, 0x06ED, 0 }, { 0x0711, 0x0711, 0 },
+    { 0x0730, 0x074A, 0 }, { 0x07A6, 0x07B0, 0 }, { 0x0900, 0x0903, 0 },
+    { 0x093A, 0x094F, 0 }, { 0x0951, 0x0957, 0 }, { 0x0E31, 0x0E31, 0 },
+    { 0x0E34, 0x0E3A, 0 }, { 0x0E47, 0x0E4E, 0 }, { 0x1AB0, 0x1AFF, 0 },
+    { 0x1DC0, 0x1DFF, 0 }, { 0x200B, 0x200F, 0 }, { 0x20D0, 0x20FF, 0 },
+    { 0xFE00, 0xFE0F, 0 }, { 0xFE20, 0xFE2F, 0 }, { 0xFEFF, 0xFEFF, 0 },
+    { 0x1100, 0x115F, 2 }, { 0x2E80, 0x303E, 2 }, { 0x3041, 0x33FF, 2 },
+    { 0x3400, 0x4DBF, 2 }, { 0x4E00, 0x9FFF, 2 }, { 0xA000, 0xA4CF, 2 },
+    { 0xAC00, 0xD7A3, 2 }, { 0xF900, 0xFAFF, 2 }, { 0xFE30, 0xFE4F, 2 },
+    { 0xFF00, 0xFF60, 2 }, { 0xFFE0, 0xFFE6, 2 },
+    { 0x1F300, 0x1F64F, 2 }, { 0x1F900, 0x1F9FF, 2 }, { 0x20000, 0x2FFFD, 2 },
+    { 0x30000, 0x3FFFD, 2 }, { 0xE0100, 0xE01EF, 0 },
+};
+
+#define WIDTH_RANGES (sizeof(kWidthRanges) / sizeof(kWidthRanges[0]))
+
+// 2 bits per BMP code point, filled once from kWidthRanges
+unsigned char CharWidthTable[0x10000 / 4];
+
+void editorInitWidthTable(){
+    memset(CharWidthTable, 0x55, sizeof(CharWidthTable)); // Width 1 everywhere
+    for(unsigned int r = 0; r < WIDTH_RANGES; r++){
+        for(int cp = kWidthRanges[r].first; cp <= kWidthRanges[r].last && cp < 0x10000; cp++){
+            CharWidthTable[cp / 4] &= ~(3 << ((cp % 4) * 2));
+            CharWidthTable[cp / 4] |= kWidthRanges[r].width << ((cp % 4) * 2);
+        }
+    }
+}
+
+int editorCharWidth(int cp){
+    if(cp < 0x10000)
+        return (CharWidthTable[cp / 4] >> ((cp % 4) * 2)) & 3;
+    for(unsigned int r = 0; r < WIDTH_RANGES; r++)
+        if(cp >= kWidthRanges[r].first && cp <= kWidthRanges[r].last)
+            return kWidthRanges[r].width;
+    return 1;
+}
+
+// Decodes the sequence at s, returning its length. Invalid bytes decode to -1.
+int utf8Decode(const char *s, int len, int *cp){
+    unsigned char c = s[0];
+    int n;
+    if(c < 0x80){
+        *cp = c;
+        return 1;
+    }
+    else if((c & 0xE0) == 0xC0){
+        n = 2;
+        *cp = c & 0x1F;
+    }
+    else if((c & 0xF0) == 0xE0){
+        n = 3;
+        *cp = c & 0x0F;
+    }
+    else if((c & 0xF8) == 0xF0){
+        n = 4;
+        *cp = c & 0x07;
+    }
+    else{
+        *cp = -1;
+        return 1;
+    }
+    
+    if(n > len){
+        *cp = -1;
+        return 1;
+    }
+    for(int i = 1; i < n; i++){
+        if(((unsigned char)s[i] & 0xC0) != 0x80){
+            *cp = -1;
+            return 1;
+        }
+        *cp = (*cp << 6) | (s[i] & 0x3F);
+    }
+    return n;
+}
+
+// Advances *j past one code point of s, returning the render column after it
+int editorNextColumn(const char *s, int len, int *j, int renderX){
+    unsigned char c = s[*j];
+    if(c == '\t'){
+        (*j)++;
+        return renderX + kTabStop - (renderX % kTabStop);
+    }
+    if(c < 0x80){
+        (*j)++;
+        return renderX + 1;
+    }
+    int cp;
+    *j += utf8Decode(&s[*j], len - *j, &cp);
+    return renderX + ((cp < 0) ? 1 : editorCharWidth(cp));
+}
+
+int utf8PrevChar(const char *s, int pos){
+    if(pos <= 0)
+        return 0;
+    int start = pos - 1;
+    while(start > 0 && pos - start < 4 && ((unsigned char)s[start] & 0xC0) == 0x80)
+        start--;
+    int cp;
+    if(start + utf8Decode(&s[start], pos - start, &cp) == pos)
+        return start;
+    return pos - 1;
+}
+
+int utf8NextChar(const char *s, int len, int pos){
+    if(pos >= len)
+        return len;
+    int cp;
+    return pos + utf8Decode(&s[pos], len - pos, &cp);
+}
+
+///// SYNTAX HIGHLIGHTING /////
+
+int isSeparator(int c) {
+    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+void editorLexInit(editorLexState *state, int inComment){
+    state->state = inComment ? LEX_MLCOMMENT : LEX_SEPARATOR;
+    state->skip = 0;
+    state->skipHl = HL_NORMAL;
+}
+
+void editorLexerSet(editorLexer *lexer, int state, int cls, int next, int hl){
+    lexer->table[state][cls] = next | (hl << 8);
+}
+
+void editorLexerAddToken(editorLexer *lexer, const char *token, int length, int kind){
+    size_t node = 0;
+    for(int i = 0; i < length; i++){
+        unsigned char c = token[i];
+        size_t child = lexer->trie[node * lexer->trieWidth + lexer->trieClass[c]];
+        if(child == 0){
+            child = lexer->trieNodes++;
+            lexer->trie[node * lexer->trieWidth + lexer->trieClass[c]] = child;
+        }
+        node = child;
+    }
+    if(length > lexer->maxToken)
+        lexer->maxToken = length;
+    // The first listing of a keyword wins, as in HLDB order
+    if(!(kind & (TOK_KEYWORD1 | TOK_KEYWORD2)) || !(lexer->trieKinds[node] & (TOK_KEYWORD1 | TOK_KEYWORD2)))
+        lexer->trieKinds[node] |= kind;
+    lexer->tokenFirst[(unsigned char)token[0]] |= kind;
+}
+
+void editorFreeLexer(editorLexer *lexer){
+    if(lexer == NULL)
+        return;
+    free(lexer->trie);
+    free(lexer->trieKinds);
+    free(lexer);
+}
+
+// Returns NULL when there isn't memory for the token trie
+editorLexer *editorCompileSyntax(struct editorSyntax *syntax){
+    editorLexer *lexer = calloc(1, sizeof(editorLexer));
+    if(lexer == NULL)
+        return NULL;
+    
+    for(int c = 0; c < 256; c++){
+        if(isSeparator(c))
+            lexer->charClass[c] = (c == '.') ? CC_DOT : CC_SEPARATOR;
+        else if(isdigit(c) && (syntax->flags & HL_HIGHLIGHT_NUMBERS))
+            lexer->charClass[c] = CC_DIGIT;
+        else if(c == '"' && (syntax->flags & HL_HIGHLIGHT_STRINGS))
+            lexer->charClass[c] = CC_DQUOTE;
+        else if(c == '\'' && (syntax->flags & HL_HIGHLIGHT_STRINGS))
+            lexer->charClass[c] = CC_SQUOTE;
+        else if(c == '\\')
+            lexer->charClass[c] = CC_BACKSLASH;
+        else
+            lexer->charClass[c] = CC_WORD;
+    }
+    
+    // Code states: separators reset, digits after a separator start numbers
+    int codeStates[] = { LEX_SEPARATOR, LEX_WORD, LEX_NUMBER };
+    for(int k = 0; k < 3; k++){
+        int state = codeStates[k];
+        editorLexerSet(lexer, state, CC_WORD, LEX_WORD, HL_NORMAL);
+        editorLexerSet(lexer, state, CC_BACKSLASH, LEX_WORD, HL_NORMAL);
+        editorLexerSet(lexer, state, CC_SEPARATOR, LEX_SEPARATOR, HL_NORMAL);
+        editorLexerSet(lexer, state, CC_DOT, LEX_SEPARATOR, HL_NORMAL);
+        editorLexerSet(lexer, state, CC_DIGIT, LEX_WORD, HL_NORMAL);
+        editorLexerSet(lexer, state, CC_DQUOTE, LEX_STRING_DQ, HL_STRING);
+        editorLexerSet(lexer, state, CC_SQUOTE, LEX_STRING_SQ, HL_STRING);
+    }
+    editorLexerSet(lexer, LEX_SEPARATOR, CC_DIGIT, LEX_NUMBER, HL_NUMBER);
+    editorLexerSet(lexer, LEX_NUMBER, CC_DIGIT, LEX_NUMBER, HL_NUMBER);
+    editorLexerSet(lexer, LEX_NUMBER, CC_DOT, LEX_NUMBER, HL_NUMBER);
+    
+    // Strings end on their own quote and skip escaped chars
+    for(int cls = 0; cls < CC_CLASSES; cls++){
+        editorLexerSet(lexer, LEX_STRING_DQ, cls, LEX_STRING_DQ, HL_STRING);
+        editorLexerSet(lexer, LEX_STRING_SQ, cls, LEX_STRING_SQ, HL_STRING);
+        editorLexerSet(lexer, LEX_ESCAPE_DQ, cls, LEX_STRING_DQ, HL_STRING);
+        editorLexerSet(lexer, LEX_ESCAPE_SQ, cls, LEX_STRING_SQ, HL_STRING);
+        editorLexerSet(lexer, LEX_MLCOMMENT, cls, LEX_MLCOMMENT, HL_MLCOMMENT);
+        editorLexerSet(lexer, LEX_COMMENT, cls, LEX_COMMENT, HL_COMMENT);
+    }
+    editorLexerSet(lexer, LEX_STRING_DQ, CC_DQUOTE, LEX_SEPARATOR, HL_STRING);
+    editorLexerSet(lexer, LEX_STRING_SQ, CC_SQUOTE, LEX_SEPARATOR, HL_STRING);
+    editorLexerSet(lexer, LEX_STRING_DQ, CC_BACKSLASH, LEX_ESCAPE_DQ, HL_STRING);
+    editorLexerSet(lexer, LEX_STRING_SQ, CC_BACKSLASH, LEX_ESCAPE_SQ, HL_STRING);
+    
+    // Number the bytes that appear in tokens so trie nodes stay narrow
+    char *scs = syntax->singleLineCommentStart;
+    char *mcs = syntax->multiLineCommentStart;
+    char *mce = syntax->multiLineCommentEnd;
+    int hasMultiLine = mcs && mce && *mcs && *mce;
+    size_t tokenChars = 0;
+    int width = 1;
+    char *delimiters[] = { scs, hasMultiLine ? mcs : NULL, hasMultiLine ? mce : NULL };
+    for(int k = 0; k < 3; k++)
+        for(char *p = delimiters[k]; p && *p; p++, tokenChars++)
+            if(!lexer->trieClass[(unsigned char)*p])
+                lexer->trieClass[(unsigned char)*p] = width++;
+    for(int j = 0; syntax->keywords[j]; j++)
+        for(char *p = syntax->keywords[j]; *p; p++, tokenChars++)
+            if(*p != '|' && !lexer->trieClass[(unsigned char)*p])
+                lexer->trieClass[(unsigned char)*p] = width++;
+    
+    if(tokenChars + 1 > UINT32_MAX){
+        editorFreeLexer(lexer);
+        return NULL;
+    }
+    lexer->trieWidth = width;
+    lexer->trieNodes = 1;
+    lexer->trie = calloc((tokenChars + 1) * width, sizeof(uint32_t));
+    lexer->trieKinds = calloc(tokenChars + 1, 1);
+    if(lexer->trie == NULL || lexer->trieKinds == NULL){
+        editorFreeLexer(lexer);
+        return NULL;
+    }
+    
+    if(scs && *scs)
+        editorLexerAddToken(lexer, scs, strlen(scs), TOK_COMMENT);
+    if(hasMultiLine){
+        editorLexerAddToken(lexer, mcs, strlen(mcs), TOK_MLCOMMENT_START);
+        editorLexerAddToken(lexer, mce, strlen(mce), TOK_MLCOMMENT_END);
+    }
+    for(int j = 0; syntax->keywords[j]; j++){
+        int kwLength = strlen(syntax->keywords[j]);
+        int kw2 = syntax->keywords[j][kwLength - 1] == '|';
+        if(kw2)
+            kwLength--;
+        if(kwLength > 0)
+            editorLexerAddToken(lexer, syntax->keywords[j], kwLength, kw2 ? TOK_KEYWORD2 : TOK_KEYWORD1);
+    }
+    
+    return lexer;
+}
+
+// Token kinds looked up in each state; keywords need a preceding separator
+const unsigned char kLexTokenMask[LEX_STATES] = {
+    [LEX_SEPARATOR] = TOK_COMMENT | TOK_MLCOMMENT_START | TOK_KEYWORD1 | TOK_KEYWORD2,
+    [LEX_WORD] = TOK_COMMENT | TOK_MLCOMMENT_START,
+    [LEX_NUMBER] = TOK_COMMENT | TOK_MLCOMMENT_START,
+    [LEX_MLCOMMENT] = TOK_MLCOMMENT_END,
+};
+
+// Longest-priority token starting at s[i], or 0. Sets *length.
+int editorLexToken(editorLexer *lexer, const char *s, int i, int mask, int *length){
+    int best = 0;
+    size_t node = 0;
+    for(int p = i; ; p++){
+        int cls = lexer->trieClass[(unsigned char)s[p]];
+        if(cls == 0)
+            break;
+        node = lexer->trie[node * lexer->trieWidth + cls];
+        if(node == 0)
+            break;
+        int kinds = lexer->trieKinds[node] & mask;
+        if(kinds & (TOK_KEYWORD1 | TOK_KEYWORD2)){
+            if(!isSeparator((unsigned char)s[p + 1]))
+                kinds &= ~(TOK_KEYWORD1 | TOK_KEYWORD2);
+        }
+        if(kinds && kinds > best){
+            best = kinds;
+            *length = p - i + 1;
+        }
+    }
+    // Only the highest priority kind on the node counts
+    while(best & (best - 1))
+        best &= best - 1;
+    return best;
+}
+
+// Adds len bytes of class hl at start, extending the last run when possible
+void editorHlMark(editorHlBuilder *builder, int start, int len, unsigned char hl){
+    if(builder->count){
+        editorHlRun *last = &builder->runs[builder->count - 1];
+        if(last->hl == hl && last->start + last->length == start && last->length + len <= 0xFFFF){
+            last->length += len;
+            return;
+        }
+    }
+    while(len > 0xFFFF){
+        editorHlMark(builder, start, 0xFFFF, hl);
+        start += 0xFFFF;
+        len -= 0xFFFF;
+    }
+    if(builder->count == builder->capacity){
+        builder->capacity = builder->capacity ? builder->capacity * 2 : 16;
+        builder->runs = editorRealloc(MEM_HIGHLIGHT, builder->runs, sizeof(editorHlRun) * builder->capacity);
+    }
+    builder->runs[builder->count].start = start;
+    builder->runs[builder->count].length = len;
+    builder->runs[builder->count].hl = hl;
+    builder->count++;
+}
+
+// Bracket type + 1 of each bracket char, negated for closing ones
+const signed char kBracketKind[256] = {
+    ['('] = 1, ['['] = 2, ['{'] = 3,
+    [')'] = -1, [']'] = -2, ['}'] = -3,
+};
+
+// Offsets of the brackets met while recording, for locating one inside a row
+struct {
+    int *offsets;
+    int count;
+    int capacity;
+    int record;
+} BracketScratch;
+
+void editorBracketsClear(editorBrackets *brackets){
+    for(int t = 0; t < BRACKET_TYPES; t++){
+        brackets->delta[t] = 0;
+        brackets->minDepth[t] = kBracketNone;
+    }
+}
+
+// Counts the bracket c found at offset i
+void editorBracketsAdd(editorBrackets *brackets, unsigned char c, int i){
+    int kind = kBracketKind[c];
+    int t = (kind > 0 ? kind : -kind) - 1;
+    brackets->delta[t] += (kind > 0) ? 1 : -1;
+    if(brackets->delta[t] < brackets->minDepth[t])
+        brackets->minDepth[t] = brackets->delta[t];
+    if(BracketScratch.record){
+        if(BracketScratch.count == BracketScratch.capacity){
+            BracketScratch.capacity = BracketScratch.capacity ? BracketScratch.capacity * 2 : 64;
+            BracketScratch.offsets = editorRealloc(MEM_BRACKETS, BracketScratch.offsets, sizeof(int) * BracketScratch.capacity);
+        }
+        BracketScratch.offsets[BracketScratch.count++] = i;
+    }
+}
+
+// Brackets of text without syntax, where every one counts
+void editorBracketsScan(const char *s, int length, editorBrackets *brackets){
+    for(int i = 0; i < length; i++)
+        if(kBracketKind[(unsigned char)s[i]])
+            editorBracketsAdd(brackets, s[i], i);
+}
+
+// Highlights s[from, to) resuming from state, which is left describing position to.
+// A NULL hl only advances the state. Brackets in code are added to brackets if set.
+void editorLexSpan(const char *s, int length, int from, int to, editorLexState *state, editorHlBuilder *hl, editorBrackets *brackets){
+    editorLexer *lexer = EditorConfig.syntax->lexer;
+    
+    int i = from;
+    if(state->skip){
+        int n = (state->skip < to - i) ? state->skip : to - i;
+        if(hl)
+            editorHlMark(hl, i, n, state->skipHl);
+        i += n;
+        state->skip -= n;
+    }
+    
+    int st = state->state;
+    while(i < to){
+        if(st == LEX_COMMENT){
+            if(hl && i < to)
+                editorHlMark(hl, i, to - i, HL_COMMENT);
+            i = to;
+            break;
+        }
+        
+        unsigned char c = s[i];
+        int cls = lexer->charClass[c];
+        if(lexer->tokenFirst[c] & kLexTokenMask[st]){
+            int mask = kLexTokenMask[st];
+            // Strings and numbers take precedence over keywords
+            if(cls == CC_DIGIT || cls == CC_DQUOTE || cls == CC_SQUOTE)
+                mask &= ~(TOK_KEYWORD1 | TOK_KEYWORD2);
+            int tokenLength = 0;
+            int kind = editorLexToken(lexer, s, i, mask, &tokenLength);
+            if(kind){
+                int tokenHl = HL_KEYWORD1;
+                if(kind == TOK_COMMENT){
+                    st = LEX_COMMENT;
+                    continue;
+                }
+                else if(kind == TOK_MLCOMMENT_START){
+                    tokenHl = HL_MLCOMMENT;
+                    st = LEX_MLCOMMENT;
+                }
+                else if(kind == TOK_MLCOMMENT_END){
+                    tokenHl = HL_MLCOMMENT;
+                    st = LEX_SEPARATOR;
+                }
+                else{
+                    tokenHl = (kind == TOK_KEYWORD2) ? HL_KEYWORD2 : HL_KEYWORD1;
+                    st = LEX_WORD;
+                }
+                if(hl)
+                    editorHlMark(hl, i, (i + tokenLength < to) ? tokenLength : to - i, tokenHl);
+                i += tokenLength;
+                if(i > to){
+                    state->skip = i - to;
+                    state->skipHl = tokenHl;
+                }
+                continue;
+            }
+        }
+        
+        // An escape on the last char of the line is an ordinary string char
+        if(cls == CC_BACKSLASH && i + 1 >= length && (st == LEX_STRING_DQ || st == LEX_STRING_SQ))
+            cls = CC_WORD;
+        if(brackets && kBracketKind[c] && st <= LEX_NUMBER)
+            editorBracketsAdd(brackets, c, i);
+        unsigned short next = lexer->table[st][cls];
+        if(hl)
+            editorHlMark(hl, i, 1, next >> 8);
+        st = next & 0xff;
+        i++;
+    }
+    state->state = st;
+}
+
+editorHlBuilder HlScratch;
+
+// Lexes render into the row's runs, keeping only as many runs as needed
+void editorHighlightRender(editorRow *row, editorLexState *state, editorBrackets *brackets){
+    HlScratch.count = 0;
+    if(EditorConfig.syntax)
+        editorLexSpan(row->render, row->renderLength, 0, row->renderLength, state, &HlScratch, brackets);
+    else if(row->renderLength)
+        editorHlMark(&HlScratch, 0, row->renderLength, HL_NORMAL);
+    
+    if(row->numHlRuns != HlScratch.count){
+        editorFree(MEM_HIGHLIGHT, row->hlRuns);
+        row->hlRuns = editorMalloc(MEM_HIGHLIGHT, sizeof(editorHlRun) * HlScratch.count);
+        row->numHlRuns = HlScratch.count;
+    }
+    memcpy(row->hlRuns, HlScratch.runs, sizeof(editorHlRun) * HlScratch.count);
+}
+
+// Lexes the materialized render window of a chunked row from its chunk state
+void editorHighlightWindow(editorRow *row){
+    editorLexState state = row->chunks[row->windowFirst].state;
+    editorHighlightRender(row, &state, NULL);
+}
+
+// Highlights one row from the comment state left by the previous one.
+// Returns whether a multi-line comment is still open at its end.
+int editorHighlightRow(editorRow *row){
+    int paged = editorRowPeek(row); // Put back when done, as passes over the file go through here
+    int inComment = row->index > 0 && EditorConfig.rows[row->index - 1].hlOpenComment;
+    editorLexState state;
+    editorLexInit(&state, inComment);
+    editorBrackets brackets;
+    editorBracketsClear(&brackets);
+    
+    int openComment = -1;
+    if(row->numChunks){
+        // Only the chunk entry states are kept; the window is lexed from them.
+        // A chunk is lexed again when its text, the text its tokens may read
+        // past its end or its entry state changed; the others keep theirs.
+        int lookahead = EditorConfig.syntax ? EditorConfig.syntax->lexer->maxToken : 0;
+        for(int k = 0; k < row->numChunks; k++){
+            editorRowChunk *chunk = &row->chunks[k];
+            int end = editorRowChunkEnd(row, k);
+            int relex = chunk->stale || memcmp(&chunk->state, &state, sizeof(editorLexState));
+            for(int n = k + 1; !relex && n < row->numChunks && row->chunks[n].charStart <= end + lookahead; n++)
+                relex = row->chunks[n].stale;
+            if(relex){
+                chunk->state = state;
+                editorBracketsClear(&chunk->brackets);
+                if(EditorConfig.syntax)
+                    editorLexSpan(row->chars, row->size, chunk->charStart, end, &state, NULL, &chunk->brackets);
+                else
+                    editorBracketsScan(&row->chars[chunk->charStart], end - chunk->charStart, &chunk->brackets);
+                chunk->stale = 0;
+            }
+            else if(k + 1 < row->numChunks){
+                state = row->chunks[k + 1].state;
+            }
+            else{
+                openComment = row->hlOpenComment;
+            }
+            editorBracketsCombine(&brackets, &brackets, &chunk->brackets);
+        }
+        if(row->render)
+            editorHighlightWindow(row);
+    }
+    else{
+        editorHighlightRender(row, &state, &brackets);
+        if(!EditorConfig.syntax)
+            editorBracketsScan(row->chars, row->size, &brackets);
+    }
+    if(memcmp(&brackets, &row->brackets, sizeof(editorBrackets))){
+        row->brackets = brackets;
+        editorBracketTreeUpdate(row->index);
+    }
+    row->hlStale = 0;
+    if(paged)
+        editorRowEvict(row);
+    return (openComment != -1) ? openComment : state.state == LEX_MLCOMMENT;
+}
+
+// Rows loaded from the cache are highlighted when first needed
+void editorRowEnsureHighlight(editorRow *row){
+    if(row->hlStale)
+        editorHighlightRow(row);
+}
+
+// Highlights rows from row through lastIndex, then keeps going while the
+// multi-line comment state carried into the next row changes
+void editorUpdateSyntaxRange(editorRow *row, int lastIndex){
+    while(1){
+        // Update after starting multi-line comment
+        int inCommentAfter = editorHighlightRow(row);
+        int changed = row->hlOpenComment != inCommentAfter;
+        row->hlOpenComment = inCommentAfter;
+        if((!changed && row->index >= lastIndex) || row->index + 1 >= EditorConfig.numRows)
+            break;
+        row = &EditorConfig.rows[row->index + 1];
+    }
+}
+
+void editorUpdateSyntax(editorRow *row){
+    editorUpdateSyntaxRange(row, row->index);
+}
+
+int editorSyntaxToColor(int hl){
+    switch(hl){
+        case HL_COMMENT:
+        case HL_MLCOMMENT: return 32;
+        case HL_KEYWORD1: return 33;
+        case HL_KEYWORD2: return 36;
+        case HL_STRING: return 31;
+        case HL_NUMBER: return 35;
+        case HL_MATCH: return 34;
+        case HL_SELECTION: return 7;
+        default: return 37;
+    }
+}
+
+void editorSelectSyntaxHighlight(){
+    // Chunks of long rows were lexed with the old syntax
+    for(int y = 0; y < EditorConfig.numRows; y++)
+        for(int k = 0; k < EditorConfig.rows[y].numChunks; k++)
+            EditorConfig.rows[y].chunks[k].stale = 1;
+    EditorConfig.syntax = NULL;
+    if(EditorConfig.filename == NULL)
+        return;
+    
+    char *ext = strrchr(EditorConfig.filename, '.');
+    
+    for(unsigned int j = 0; j < LoadedSyntaxEntries + HLDB_ENTRIES; j++){
+        struct editorSyntax *s = (j < LoadedSyntaxEntries) ? &LoadedSyntax[j] : &HLDB[j - LoadedSyntaxEntries];
+        unsigned int i = 0;
+        while(s->fileMatch[i]){
+            int isExt = (s->fileMatch[i][0] == '.');
+            if ((isExt && ext && !strcmp(ext, s->fileMatch[i])) ||
+                (!isExt && strstr(EditorConfig.filename, s->fileMatch[i]))) {
+                if(s->lexer == NULL)
+                    s->lexer = editorCompileSyntax(s);
+                if(s->lexer == NULL){
+                    editorSetStatusMessage("Not enough memory to highlight %s", s->fileType);
+                    return;
+                }
+                EditorConfig.syntax = s;
+                
+                for(int fileRow = 0; fileRow < EditorConfig.numRows; fileRow++)
+                    editorUpdateSyntax(&EditorConfig.rows[fileRow]);
+                
+                return;
+            }
+            i++;
+        }
+    }
+}
+
+// Appends the whitespace separated words of line to a NULL terminated list
+char **editorSyntaxAddWords(char **list, char *line){
+    int count = 0;
+    while(list && list[count])
+        count++;
+    for(char *word = strtok(line, " \t"); word; word = strtok(NULL, " \t")){
+        list = realloc(list, sizeof(char *) * (count + 2));
+        list[count++] = strdup(word);
+        list[count] = NULL;
+    }
+    return list;
+}
+
+/*
+    Loads definitions like the following, one directive per line:
+        filetype python
+        match .py SConstruct
+        keywords if else while for def class return
+        keywords int| str| float|
+        comment #
+        multiline """ """
+        flags numbers strings
+*/
+void editorLoadSyntaxFile(const char *path){
+    FILE *fp = fopen(path, "r");
+    if(!fp)
+        return;
+    
+    char *line = NULL;
+    size_t lineCap = 0;
+    ssize_t lineLength;
+    struct editorSyntax *s = NULL;
+    while((lineLength = getline(&line, &lineCap, fp)) != -1){
+        while(lineLength > 0 && isspace((unsigned char)line[lineLength - 1]))
+            line[--lineLength] = '\0';
+        
+        char *value = strpbrk(line, " \t");
+        if(value){
+            *value++ = '\0';
+            while(isspace((unsigned char)*value))
+                value++;
+        }
+        else
+            value = line + lineLength;
+        
+        if(line[0] == '#' || line[0] == '\0')
+            continue;
+        if(!strcmp(line, "filetype")){
+            LoadedSyntax = realloc(LoadedSyntax, sizeof(struct editorSyntax) * (LoadedSyntaxEntries + 1));
+            s = &LoadedSyntax[LoadedSyntaxEntries++];
+            memset(s, 0, sizeof(*s));
+            s->fileType = strdup(value);
+            s->fileMatch = calloc(1, sizeof(char *));
+            s->keywords = calloc(1, sizeof(char *));
+            continue;
+        }
+        if(s == NULL)
+            continue;
+        
+        if(!strcmp(line, "match"))
+            s->fileMatch = editorSyntaxAddWords(s->fileMatch, value);
+        else if(!strcmp(line, "keywords"))
+            s->keywords = editorSyntaxAddWords(s->keywords, value);
+        else if(!strcmp(line, "comment"))
+            s->singleLineCommentStart = strdup(value);
+        else if(!strcmp(line, "multiline")){
+            char *end = strpbrk(value, " \t");
+            if(end){
+                *end++ = '\0';
+                while(isspace((unsigned char)*end))
+                    end++;
+                s->multiLineCommentStart = strdup(value);
+                s->multiLineCommentEnd = strdup(end);
+            }
+        }
+        else if(!strcmp(line, "flags")){
+            if(strstr(value, "numbers"))
+                s->flags |= HL_HIGHLIGHT_NUMBERS;
+            if(strstr(value, "strings"))
+                s->flags |= HL_HIGHLIGHT_STRINGS;
+        }
+    }
+    free(line);
+    fclose(fp);
+}
+
+void editorLoadSyntax(){
+    char *path = getenv("KBEDITOR_SYNTAX");
+    if(path){
+        editorLoadSyntaxFile(path);
+        return;
+    }
+    
+    char *home = getenv("HOME");
+    if(home){
+        char buf[1024];
+        snprintf(buf, sizeof(buf), "%s/.kbeditor_syntax", home);
+        editorLoadSyntaxFile(buf);
+    }
+}
+
+///// BRACKETS /////
+
+void editorBracketsCombine(editorBrackets *out, const editorBrackets *left, const editorBrackets *right){
+    for(int t = 0; t < BRACKET_TYPES; t++){
+        int rightMin = left->delta[t] + right->minDepth[t];
+        out->minDepth[t] = (left->minDepth[t] < rightMin) ? left->minDepth[t] : rightMin;
+        out->delta[t] = left->delta[t] + right->delta[t];
+    }
+}
+
+// Whether a span entered at depth has a bracket of type t that leaves it at most limit
+int editorBracketsReach(const editorBrackets *brackets, int t, int depth, int limit){
+    return brackets->minDepth[t] < kBracketNone / 2 && depth + brackets->minDepth[t] <= limit;
+}
+
+// Summary of the rows of one leaf, which starts at row first
+void editorBracketLeaf(int leaf, int first, editorBrackets *out){
+    editorBracketsClear(out);
+    int last = first + BracketTree.rows[BracketTree.size + leaf];
+    for(int j = first; j < last; j++)
+        editorBracketsCombine(out, out, &EditorConfig.rows[j].brackets);
+}
+
+// First row of a leaf
+int editorBracketLeafStart(int leaf){
+    int first = 0;
+    for(int l = BracketTree.size, r = BracketTree.size + leaf; l < r; l /= 2, r /= 2){
+        if(l & 1)
+            first += BracketTree.rows[l++];
+        if(r & 1)
+            first += BracketTree.rows[--r];
+    }
+    return first;
+}
+
+// Leaf holding row y, with its first row in *first. Rows past the end give
+// the first empty leaf.
+int editorBracketLeafOf(int y, int *first){
+    *first = 0;
+    if(y >= BracketTree.rows[1]){
+        *first = BracketTree.rows[1];
+        return BracketTree.leaves;
+    }
+    int node = 1;
+    while(node < BracketTree.size){
+        node *= 2;
+        if(y >= *first + BracketTree.rows[node]){
+            *first += BracketTree.rows[node];
+            node++;
+        }
+    }
+    return node - BracketTree.size;
+}
+
+// Recomputes the nodes above leaves first through last
+void editorBracketTreeRefold(int first, int last){
+    int lo = (BracketTree.size + first) / 2;
+    int hi = (BracketTree.size + last) / 2;
+    for(; lo >= 1; lo /= 2, hi /= 2){
+        for(int node = lo; node <= hi; node++){
+            editorBracketsCombine(&BracketTree.nodes[node], &BracketTree.nodes[2 * node], &BracketTree.nodes[2 * node + 1]);
+            BracketTree.rows[node] = BracketTree.rows[2 * node] + BracketTree.rows[2 * node + 1];
+        }
+    }
+}
+
+// Resizes the tree to size leaves, keeping the leaves in use
+void editorBracketTreeResize(int size){
+    editorBrackets *nodes = editorMalloc(MEM_BRACKETS, sizeof(editorBrackets) * size * 2);
+    int *rows = editorMalloc(MEM_BRACKETS, sizeof(int) * size * 2);
+    for(int leaf = 0; leaf < size; leaf++){
+        if(leaf < BracketTree.leaves){
+            nodes[size + leaf] = BracketTree.nodes[BracketTree.size + leaf];
+            rows[size + leaf] = BracketTree.rows[BracketTree.size + leaf];
+        }
+        else{
+            editorBracketsClear(&nodes[size + leaf]);
+            rows[size + leaf] = 0;
+        }
+    }
+    editorFree(MEM_BRACKETS, BracketTree.nodes);
+    editorFree(MEM_BRACKETS, BracketTree.rows);
+    BracketTree.nodes = nodes;
+    BracketTree.rows = rows;
+    BracketTree.size = size;
+    editorBracketTreeRefold(0, size - 1);
+}
+
+void editorBracketTreeUpdate(int index){
+    if(!BracketTree.valid)
+        return;
+    int first;
+    int leaf = editorBracketLeafOf(index, &first);
+    int node = BracketTree.size + leaf;
+    editorBracketLeaf(leaf, first, &BracketTree.nodes[node]);
+    for(node /= 2; node >= 1; node /= 2)
+        editorBracketsCombine(&BracketTree.nodes[node], &BracketTree.nodes[2 * node], &BracketTree.nodes[2 * node + 1]);
+}
+
+// Splits a leaf that has grown to twice its size in two
+void editorBracketTreeSplit(int leaf, int first){
+    if(BracketTree.leaves == BracketTree.size)
+        editorBracketTreeResize(BracketTree.size * 2);
+    int node = BracketTree.size + leaf;
+    int moved = BracketTree.leaves - leaf - 1;
+    memmove(&BracketTree.nodes[node + 2], &BracketTree.nodes[node + 1], sizeof(editorBrackets) * moved);
+    memmove(&BracketTree.rows[node + 2], &BracketTree.rows[node + 1], sizeof(int) * moved);
+    BracketTree.leaves++;
+    
+    int count = BracketTree.rows[node];
+    BracketTree.rows[node] = count / 2;
+    BracketTree.rows[node + 1] = count - count / 2;
+    editorBracketLeaf(leaf, first, &BracketTree.nodes[node]);
+    editorBracketLeaf(leaf + 1, first + count / 2, &BracketTree.nodes[node + 1]);
+    editorBracketTreeRefold(leaf, BracketTree.leaves - 1);
+}
+
+// Merges leaf + 1 into leaf
+void editorBracketTreeMerge(int leaf, int first){
+    int node = BracketTree.size + leaf;
+    int moved = BracketTree.leaves - leaf - 2;
+    BracketTree.rows[node] += BracketTree.rows[node + 1];
+    memmove(&BracketTree.nodes[node + 1], &BracketTree.nodes[node + 2], sizeof(editorBrackets) * moved);
+    memmove(&BracketTree.rows[node + 1], &BracketTree.rows[node + 2], sizeof(int) * moved);
+    BracketTree.leaves--;
+    editorBracketsClear(&BracketTree.nodes[BracketTree.size + BracketTree.leaves]);
+    BracketTree.rows[BracketTree.size + BracketTree.leaves] = 0;
+    
+    editorBracketLeaf(leaf, first, &BracketTree.nodes[node]);
+    editorBracketTreeRefold(leaf, BracketTree.leaves);
+}
+
+// Counts a row inserted at pos, before it is highlighted. Its brackets are
+// still empty, so only the row counts on the path of its leaf change.
+void editorBracketTreeInsert(int pos){
+    if(!BracketTree.valid)
+        return;
+    int first = 0;
+    int leaf = (pos > 0) ? editorBracketLeafOf(pos - 1, &first) : 0;
+    BracketTree.rows[BracketTree.size + leaf]++;
+    editorBracketTreeRefold(leaf, leaf);
+    if(BracketTree.rows[BracketTree.size + leaf] > 2 * kBracketLeafRows)
+        editorBracketTreeSplit(leaf, first);
+}
+
+// Drops the row that was at pos, once the rows after it have moved up
+void editorBracketTreeDelete(int pos){
+    if(!BracketTree.valid)
+        return;
+    int first;
+    int leaf = editorBracketLeafOf(pos, &first);
+    int node = BracketTree.size + leaf;
+    BracketTree.rows[node]--;
+    editorBracketLeaf(leaf, first, &BracketTree.nodes[node]);
+    editorBracketTreeRefold(leaf, leaf);
+    
+    if(BracketTree.rows[node] >= kBracketLeafRows / 2 || BracketTree.leaves == 1)
+        return;
+    if(leaf + 1 < BracketTree.leaves){
+        if(BracketTree.rows[node] + BracketTree.rows[node + 1] <= 2 * kBracketLeafRows)
+            editorBracketTreeMerge(leaf, first);
+    }
+    else if(BracketTree.rows[node - 1] + BracketTree.rows[node] <= 2 * kBracketLeafRows)
+        editorBracketTreeMerge(leaf - 1, first - BracketTree.rows[node - 1]);
+}
+
+// Builds the tree over all rows after a file was loaded, highlighting rows
+// that were loaded from the cache so their brackets are known
+void editorBracketTreeBuild(){
+    if(BracketTree.valid)
+        return;
+    for(int j = 0; j < EditorConfig.numRows; j++)
+        editorRowEnsureHighlight(&EditorConfig.rows[j]);
+    
+    int leaves = (EditorConfig.numRows + kBracketLeafRows - 1) / kBracketLeafRows;
+    if(leaves == 0)
+        leaves = 1;
+    int size = 1;
+    while(size < leaves)
+        size *= 2;
+    if(size != BracketTree.size){
+        BracketTree.nodes = editorRealloc(MEM_BRACKETS, BracketTree.nodes, sizeof(editorBrackets) * size * 2);
+        BracketTree.rows = editorRealloc(MEM_BRACKETS, BracketTree.rows, sizeof(int) * size * 2);
+        BracketTree.size = size;
+    }
+    BracketTree.leaves = leaves;
+    for(int leaf = 0; leaf < size; leaf++){
+        int first = leaf * kBracketLeafRows;
+        int count = EditorConfig.numRows - first;
+        BracketTree.rows[size + leaf] = count < 0 ? 0 : count > kBracketLeafRows ? kBracketLeafRows : count;
+        editorBracketLeaf(leaf, first, &BracketTree.nodes[size + leaf]);
+    }
+    editorBracketTreeRefold(0, size - 1);
+    BracketTree.valid = 1;
+}
+
+// Depth of type t brackets at the start of row y
+int editorBracketDepthBefore(int t, int y){
+    int depth = 0;
+    int first;
+    int leaf = editorBracketLeafOf(y, &first);
+    for(int l = BracketTree.size, r = BracketTree.size + leaf; l < r; l /= 2, r /= 2){
+        if(l & 1)
+            depth += BracketTree.nodes[l++].delta[t];
+        if(r & 1)
+            depth += BracketTree.nodes[--r].delta[t];
+    }
+    for(int j = first; j < y; j++)
+        depth += EditorConfig.rows[j].brackets.delta[t];
+    return depth;
+}
+
+// First leaf at or after from in [lo, hi) reaching limit; *depth enters at from
+int editorBracketFirstLeaf(int node, int lo, int hi, int from, int t, int limit, int *depth){
+    if(hi <= from)
+        return -1;
+    editorBrackets *brackets = &BracketTree.nodes[node];
+    if(lo >= from && !editorBracketsReach(brackets, t, *depth, limit)){
+        *depth += brackets->delta[t];
+        return -1;
+    }
+    if(hi - lo == 1)
+        return lo;
+    int mid = (lo + hi) / 2;
+    int leaf = editorBracketFirstLeaf(2 * node, lo, mid, from, t, limit, depth);
+    return (leaf != -1) ? leaf : editorBracketFirstLeaf(2 * node + 1, mid, hi, from, t, limit, depth);
+}
+
+// Last leaf before end in [lo, hi) reaching limit; *depth is the depth at end
+int editorBracketLastLeaf(int node, int lo, int hi, int end, int t, int limit, int *depth){
+    if(lo >= end)
+        return -1;
+    editorBrackets *brackets = &BracketTree.nodes[node];
+    if(hi <= end){
+        int start = *depth - brackets->delta[t];
+        if(!editorBracketsReach(brackets, t, start, limit)){
+            *depth = start;
+            return -1;
+        }
+        if(hi - lo == 1){
+            *depth = start;
+            return lo;
+        }
+    }
+    int mid = (lo + hi) / 2;
+    int leaf = editorBracketLastLeaf(2 * node + 1, mid, hi, end, t, limit, depth);
+    return (leaf != -1) ? leaf : editorBracketLastLeaf(2 * node, lo, mid, end, t, limit, depth);
+}
+
+// First row at or after from whose type t brackets go down to limit.
+// *depth is left at the start of that row.
+int editorBracketFirstRow(int from, int t, int limit, int *depth){
+    if(from >= EditorConfig.numRows)
+        return -1;
+    *depth = editorBracketDepthBefore(t, from);
+    int first;
+    int leaf = editorBracketLeafOf(from, &first);
+    int y = from;
+    for(int pass = 0; pass < 2; pass++){
+        int last = first + BracketTree.rows[BracketTree.size + leaf];
+        for(; y < last; y++){
+            if(editorBracketsReach(&EditorConfig.rows[y].brackets, t, *depth, limit))
+                return y;
+            *depth += EditorConfig.rows[y].brackets.delta[t];
+        }
+        leaf = editorBracketFirstLeaf(1, 0, BracketTree.size, leaf + 1, t, limit, depth);
+        if(leaf == -1)
+            return -1;
+        first = editorBracketLeafStart(leaf);
+        y = first;
+    }
+    return -1;
+}
+
+// Last row before end whose type t brackets go down to limit, with *depth
+// left at the start of that row
+int editorBracketLastRow(int end, int t, int limit, int *depth){
+    *depth = editorBracketDepthBefore(t, end);
+    int first;
+    int leaf = editorBracketLeafOf(end, &first);
+    int y = end - 1;
+    for(int pass = 0; pass < 2; pass++){
+        for(; y >= first; y--){
+            *depth -= EditorConfig.rows[y].brackets.delta[t];
+            if(editorBracketsReach(&EditorConfig.rows[y].brackets, t, *depth, limit))
+                return y;
+        }
+        if(first == 0)
+            return -1;
+        leaf = editorBracketLastLeaf(1, 0, BracketTree.size, leaf, t, limit, depth);
+        if(leaf == -1)
+            return -1;
+        // The leaf was entered at *depth; scan it back from its end
+        first = editorBracketLeafStart(leaf);
+        int last = first + BracketTree.rows[BracketTree.size + leaf];
+        for(int j = first; j < last; j++)
+            *depth += EditorConfig.rows[j].brackets.delta[t];
+        y = last - 1;
+    }
+    return -1;
+}
+
+// Offsets of the code brackets of row y, left in BracketScratch
+void editorRowBracketOffsets(int y){
+    editorRow *row = &EditorConfig.rows[y];
+    editorRowLoad(row);
+    editorBrackets brackets;
+    editorBracketsClear(&brackets);
+    BracketScratch.count = 0;
+    BracketScratch.record = 1;
+    if(EditorConfig.syntax){
+        editorLexState state;
+        editorLexInit(&state, y > 0 && EditorConfig.rows[y - 1].hlOpenComment);
+        editorLexSpan(row->chars, row->size, 0, row->size, &state, NULL, &brackets);
+    }
+    else
+        editorBracketsScan(row->chars, row->size, &brackets);
+    BracketScratch.record = 0;
+}
+
+// Sign of the bracket at offset k of BracketScratch if it has type t, else 0
+int editorBracketStep(editorRow *row, int k, int t){
+    int kind = kBracketKind[(unsigned char)row->chars[BracketScratch.offsets[k]]];
+    if(kind == t + 1)
+        return 1;
+    return (kind == -(t + 1)) ? -1 : 0;
+}
+
+// First type t bracket at or after x in row y, or in a later row
+int editorBracketNext(int t, int y, int x, int *outY, int *outX){
+    int depth;
+    while(y != -1){
+        editorRowBracketOffsets(y);
+        editorRow *row = &EditorConfig.rows[y];
+        for(int k = 0; k < BracketScratch.count; k++){
+            if(BracketScratch.offsets[k] >= x && editorBracketStep(row, k, t)){
+                *outY = y;
+                *outX = BracketScratch.offsets[k];
+                return 1;
+            }
+        }
+        y = editorBracketFirstRow(y + 1, t, INT_MAX / 2, &depth);
+        x = 0;
+    }
+    return 0;
+}
+
+// Closing bracket of the innermost type t block around offset x of row y
+int editorBracketForward(int t, int y, int x, int *outY, int *outX){
+    int depth = editorBracketDepthBefore(t, y);
+    editorRowBracketOffsets(y);
+    editorRow *row = &EditorConfig.rows[y];
+    int k = 0;
+    for(; k < BracketScratch.count && BracketScratch.offsets[k] < x; k++)
+        depth += editorBracketStep(row, k, t);
+    int limit = depth - 1;
+    
+    while(1){
+        for(; k < BracketScratch.count; k++){
+            depth += editorBracketStep(row, k, t);
+            if(editorBracketStep(row, k, t) && depth <= limit){
+                *outY = y;
+                *outX = BracketScratch.offsets[k];
+                return 1;
+            }
+        }
+        y = editorBracketFirstRow(y + 1, t, limit, &depth);
+        if(y == -1)
+            return 0;
+        editorRowBracketOffsets(y);
+        row = &EditorConfig.rows[y];
+        k = 0;
+    }
+}
+
+// Opening bracket of the innermost type t block around offset x of row y:
+// the bracket after the last one before x that drops below the depth at x
+int editorBracketBackward(int t, int y, int x, int *outY, int *outX){
+    int start = editorBracketDepthBefore(t, y);
+    editorRowBracketOffsets(y);
+    editorRow *row = &EditorConfig.rows[y];
+    int depth = start;
+    int count = 0;
+    for(; count < BracketScratch.count && BracketScratch.offsets[count] < x; count++)
+        depth += editorBracketStep(row, count, t);
+    int limit = depth - 1;
+    
+    int lowY = y;
+    while(1){
+        int low = -1;
+        depth = start;
+        for(int k = 0; k < count; k++){
+            depth += editorBracketStep(row, k, t);
+            if(editorBracketStep(row, k, t) && depth <= limit)
+                low = BracketScratch.offsets[k];
+        }
+        if(low != -1)
+            return editorBracketNext(t, lowY, low + 1, outY, outX);
+        lowY = editorBracketLastRow(lowY, t, limit, &start);
+        if(lowY == -1)
+            break;
+        editorRowBracketOffsets(lowY);
+        row = &EditorConfig.rows[lowY];
+        count = BracketScratch.count;
+    }
+    // Nothing before x is shallow enough, unless the start of the file is
+    return limit >= 0 && editorBracketNext(t, 0, 0, outY, outX);
+}
+
+// Fold whose hidden rows include row, or -1
+int editorFoldAt(int row){
+    int lo = 0;
+    int hi = EditorConfig.numFolds;
+    while(lo < hi){
+        int mid = (lo + hi) / 2;
+        if(EditorConfig.folds[mid].end <= row)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if(lo < EditorConfig.numFolds && EditorConfig.folds[lo].start < row)
+        return lo;
+    return -1;
+}
+
+int editorNextVisibleRow(int row){
+    int fold = editorFoldAt(row + 1);
+    return (fold == -1) ? row + 1 : EditorConfig.folds[fold].end;
+}
+
+int editorPrevVisibleRow(int row){
+    int fold = editorFoldAt(row - 1);
+    return (fold == -1) ? row - 1 : EditorConfig.folds[fold].start;
+}
+
+// Screen lines taken by the rows from first up to row
+int editorVisibleLines(int first, int row, int max){
+    int lines = 0;
+    for(int j = first; j < row && lines < max; j = editorNextVisibleRow(j))
+        lines++;
+    return lines;
+}
+
+void editorFoldRemove(int fold){
+    memmove(&EditorConfig.folds[fold], &EditorConfig.folds[fold + 1], sizeof(editorFold) * (EditorConfig.numFolds - fold - 1));
+    EditorConfig.numFolds--;
+}
+
+// Hides the rows between start and end, replacing folds it overlaps
+void editorFoldAdd(int start, int end){
+    int kept = 0;
+    for(int f = 0; f < EditorConfig.numFolds; f++)
+        if(EditorConfig.folds[f].end <= start || EditorConfig.folds[f].start >= end)
+            EditorConfig.folds[kept++] = EditorConfig.folds[f];
+    EditorConfig.numFolds = kept;
+    
+    EditorConfig.folds = editorRealloc(MEM_BRACKETS, EditorConfig.folds, sizeof(editorFold) * (EditorConfig.numFolds + 1));
+    int pos = 0;
+    while(pos < EditorConfig.numFolds && EditorConfig.folds[pos].start < start)
+        pos++;
+    memmove(&EditorConfig.folds[pos + 1], &EditorConfig.folds[pos], sizeof(editorFold) * (EditorConfig.numFolds - pos));
+    EditorConfig.folds[pos].start = start;
+    EditorConfig.folds[pos].end = end;
+    EditorConfig.numFolds++;
+}
+
+// Keeps folds on their rows when a row is inserted (delta 1) or deleted
+// (delta -1) at pos. Deleting a row of a fold opens it.
+void editorFoldsShift(int pos, int delta){
+    for(int f = EditorConfig.numFolds - 1; f >= 0; f--){
+        editorFold *fold = &EditorConfig.folds[f];
+        if(fold->start >= pos + (delta < 0)){
+            fold->start += delta;
+            fold->end += delta;
+        }
+        else if(delta > 0 && fold->end >= pos)
+            fold->end++;
+        else if(delta < 0 && fold->end >= pos)
+            editorFoldRemove(f);
+    }
+}
+
+void editorFoldsClear(){
+    editorFree(MEM_BRACKETS, EditorConfig.folds);
+    EditorConfig.folds = NULL;
+    EditorConfig.numFolds = 0;
+}
+
+// Code bracket at or just before the cursor; returns its offset or -1
+int editorBracketAtCursor(){
+    editorRowBracketOffsets(EditorConfig.cursorY);
+    for(int x = EditorConfig.cursorX; x >= EditorConfig.cursorX - 1 && x >= 0; x--)
+        for(int k = 0; k < BracketScratch.count; k++)
+            if(BracketScratch.offsets[k] == x)
+                return x;
+    return -1;
+}
+
+void editorMatchBracket(){
+    if(EditorConfig.cursorY >= EditorConfig.numRows)
+        return;
+    editorBracketTreeBuild();
+    int x = editorBracketAtCursor();
+    if(x == -1){
+        editorSetStatusMessage("No bracket at the cursor");
+        return;
+    }
+    int kind = kBracketKind[(unsigned char)EditorConfig.rows[EditorConfig.cursorY].chars[x]];
+    int y = EditorConfig.cursorY;
+    int found = (kind > 0)
+        ? editorBracketForward(kind - 1, y, x + 1, &EditorConfig.cursorY, &EditorConfig.cursorX)
+        : editorBracketBackward(-kind - 1, y, x, &EditorConfig.cursorY, &EditorConfig.cursorX);
+    if(!found)
+        editorSetStatusMessage("No matching bracket");
+}
+
+// Moves to the brace opening (or closing) the block around the cursor
+void editorBlockJump(int toEnd){
+    if(EditorConfig.cursorY >= EditorConfig.numRows)
+        return;
+    editorBracketTreeBuild();
+    int y = EditorConfig.cursorY;
+    int x = EditorConfig.cursorX;
+    int found = toEnd
+        ? editorBracketForward(2, y, x + 1, &EditorConfig.cursorY, &EditorConfig.cursorX)
+        : editorBracketBackward(2, y, x, &EditorConfig.cursorY, &EditorConfig.cursorX);
+    if(!found)
+        editorSetStatusMessage("Not inside a block");
+}
+
+// Folds the block opened on the cursor row, or else the one around it
+void editorToggleFold(){
+    int y = EditorConfig.cursorY;
+    for(int f = 0; f < EditorConfig.numFolds; f++){
+        if(EditorConfig.folds[f].start == y){
+            editorFoldRemove(f);
+            return;
+        }
+    }
+    if(y >= EditorConfig.numRows)
+        return;
+    
+    editorBracketTreeBuild();
+    int size = EditorConfig.rows[y].size;
+    int startY, startX, endY, endX;
+    if(!editorBracketBackward(2, y, size, &startY, &startX) || !editorBracketForward(2, y, size, &endY, &endX)){
+        editorSetStatusMessage("Not inside a block");
+        return;
+    }
+    if(endY - startY < 2){
+        editorSetStatusMessage("Nothing to fold");
+        return;
+    }
+    editorFoldAdd(startY, endY);
+    EditorConfig.cursorY = startY;
+    EditorConfig.cursorX = startX;
+}
+
+///// ROW OPERATIONS /////
+
+int editorRowChunkAtChar(editorRow *row, int cursorX){
+    int low = 0;
+    int high = row->numChunks - 1;
+    while(low < high){
+        int mid = (low + high + 1) / 2;
+        if(row->chunks[mid].charStart <= cursorX)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+    return low;
+}
+
+int editorRowChunkEnd(editorRow *row, int k){
+    return (k + 1 < row->numChunks) ? row->chunks[k + 1].charStart : row->size;
+}
+
+int editorRowCursorToRender(editorRow *row, int cursorX){
+    if(row->plain)
+        return cursorX;
+    
+    int renderX = 0;
+    int j = 0;
+    if(row->numChunks && cursorX > 0){
+        int k = editorRowChunkAtChar(row, cursorX - 1);
+        renderX = row->chunks[k].renderStart;
+        j = row->chunks[k].charStart;
+    }
+    while (j < cursorX)
+        renderX = editorNextColumn(row->chars, row->size, &j, renderX);
+    return renderX;
+
+    // TODO
+    /*
+        int lastTab = -1;
+        for (int j = 0; j < cursorX; j++)
+            if (row->chars[j] == '\t')
+                lastTab = j;
+        if(lastTab != -1 && cursorX - lastTab < kTabStop)
+            return lastTab + kTabStop;
+        return cursorX; 
+    */
+}
+
+int editorRowChunkAtRender(editorRow *row, int renderX){
+    int low = 0;
+    int high = row->numChunks - 1;
+    while(low < high){
+        int mid = (low + high + 1) / 2;
+        if(row->chunks[mid].renderStart <= renderX)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+    return low;
+}
+
+int editorRowRenderToCursor(editorRow *row, int renderX){
+    if(row->plain)
+        return (renderX < row->size) ? renderX : row->size;
+    
+    int currentRenderX = 0;
+    int cursorX = 0;
+    if(row->numChunks){
+        int k = editorRowChunkAtRender(row, renderX);
+        currentRenderX = row->chunks[k].renderStart;
+        cursorX = row->chunks[k].charStart;
+    }
+    while (cursorX < row->size) {
+        int next = cursorX;
+        currentRenderX = editorNextColumn(row->chars, row->size, &next, currentRenderX);
+        if (currentRenderX > renderX) 
+            return cursorX;
+        cursorX = next;
+    }
+    return cursorX;
+}
+
+// Byte offset in the materialized render of chars[cursorX]
+int editorRowRenderIndex(editorRow *row, int cursorX){
+    int j = row->numChunks ? row->chunks[row->windowFirst].charStart : 0;
+    int renderX = row->renderStart;
+    int idx = 0;
+    while(j < cursorX && j < row->size){
+        int prevJ = j;
+        int prevX = renderX;
+        renderX = editorNextColumn(row->chars, row->size, &j, renderX);
+        idx += (row->chars[prevJ] == '\t') ? renderX - prevX : j - prevJ;
+    }
+    return idx;
+}
+
+// Expands chars[from, to) into render, starting at render column startX
+void editorRowBuildRender(editorRow *row, int from, int to, int startX, int capacity){
+    editorFree(MEM_RENDER, row->render);
+    row->render = editorMalloc(MEM_RENDER, capacity + 1);
+    
+    int idx = 0;
+    int renderX = startX;
+    int j = from;
+    while (j < to){
+        int prevJ = j;
+        int prevX = renderX;
+        renderX = editorNextColumn(row->chars, row->size, &j, renderX);
+        if(row->chars[prevJ] == '\t')
+            while(prevX++ < renderX)
+                row->render[idx++] = ' ';
+        else
+            while(prevJ < j)
+                row->render[idx++] = row->chars[prevJ++];
+    }
+    row->render[idx] = '\0';
+    row->renderStart = startX;
+    row->renderLength = idx;
+}
+
+// Materializes render and highlighting for the chunks covering [renderX, renderX + width)
+void editorRowRenderWindow(editorRow *row, int renderX, int width){
+    if(row->numChunks == 0)
+        return;
+    
+    int first = editorRowChunkAtRender(row, renderX);
+    int last = editorRowChunkAtRender(row, renderX + width) + 1;
+    if(row->render && first >= row->windowFirst && last <= row->windowLast)
+        return;
+    
+    // One chunk of margin on each side keeps small scrolls from rebuilding
+    if(first > 0)
+        first--;
+    if(last < row->numChunks)
+        last++;
+    
+    int from = row->chunks[first].charStart;
+    int to = editorRowChunkEnd(row, last - 1);
+    int tabs = 0;
+    for(int j = from; j < to; j++)
+        if(row->chars[j] == '\t')
+            tabs++;
+    editorRowBuildRender(row, from, to, row->chunks[first].renderStart, to - from + tabs * (kTabStop - 1));
+    row->windowFirst = first;
+    row->windowLast = last;
+    editorHighlightWindow(row);
+}
+
+// Cuts chars[from, to) into count chunks of about equal size, written from
+// chunks[k] on and counting render columns on from *renderX. Returns 0 if a
+// char runs past to.
+int editorRowCutChunks(editorRow *row, int k, int from, int to, int count, int *renderX){
+    int size = (to - from) / count;
+    int made = 0;
+    int j = from;
+    while(j < to){
+        if(made < count && j >= from + made * size){
+            editorRowChunk *chunk = &row->chunks[k + made++];
+            chunk->charStart = j;
+            chunk->renderStart = *renderX;
+            chunk->plain = 1;
+            chunk->tabs = 0;
+            chunk->stale = 1;
+        }
+        if(row->chars[j] == '\t')
+            row->chunks[k + made - 1].tabs = 1;
+        if(row->chars[j] == '\t' || (unsigned char)row->chars[j] >= 0x80)
+            row->chunks[k + made - 1].plain = 0;
+        *renderX = editorNextColumn(row->chars, row->size, &j, *renderX);
+    }
+    return j == to && made == count;
+}
+
+// Drops the render window of a chunked row whose chunk table changed
+void editorRowChunksChanged(editorRow *row){
+    row->plain = 1;
+    for(int k = 0; k < row->numChunks; k++)
+        if(!row->chunks[k].plain)
+            row->plain = 0;
+    editorFree(MEM_RENDER, row->render);
+    row->render = NULL;
+    row->renderStart = 0;
+    row->renderLength = 0;
+    row->windowFirst = 0;
+    row->windowLast = 0;
+}
+
+// Rebuilds the render (or chunk table) of a row without touching its highlighting
+void editorUpdateRowRender(editorRow *row){
+    editorFree(MEM_RENDER, row->render);
+    row->render = NULL;
+    
+    // Column offsets are cached here so drawing never rescans from column 0
+    if(row->size > kRowChunkSize){
+        // Long rows only keep per-chunk columns; render is built on demand
+        row->numChunks = row->size / kRowChunkSize;
+        row->chunks = editorRealloc(MEM_CHUNKS, row->chunks, sizeof(editorRowChunk) * row->numChunks);
+        int renderX = 0;
+        editorRowCutChunks(row, 0, 0, row->size, row->numChunks, &renderX);
+        row->renderSize = renderX;
+        editorRowChunksChanged(row);
+    }
+    else{
+        editorFree(MEM_CHUNKS, row->chunks);
+        row->chunks = NULL;
+        row->numChunks = 0;
+        
+        int tabs = 0;
+        int plain = 1;
+        for(int j = 0; j < row->size; j++){
+            if(row->chars[j] == '\t'){
+                tabs++;
+                plain = 0;
+            }
+            else if((unsigned char)row->chars[j] >= 0x80)
+                plain = 0;
+        }
+        row->plain = plain;
+        editorRowBuildRender(row, 0, row->size, 0, row->size + tabs * (kTabStop - 1));
+        row->renderSize = editorRowCursorToRender(row, row->size);
+    }
+}
+
+void editorUpdateRow(editorRow *row){
+    editorWordsUpdate(row);
+    row->pageOffset = -1;
+    editorUpdateRowRender(row);
+    editorUpdateSyntax(row);
+}
+
+// Cuts the chunks around an edit of a long row that turned chars [from, oldTo)
+// into [from, newTo) again, merged with a neighbour while under half a chunk.
+// The later chunks keep their lexer state and brackets and only move over.
+void editorRowRechunk(editorRow *row, int from, int oldTo, int newTo){
+    int shift = newTo - oldTo;
+    int oldSize = row->size - shift;
+    // A char ending in the edit starts up to 3 bytes before it
+    int first = editorRowChunkAtChar(row, (from > 3) ? from - 3 : 0);
+    int last = editorRowChunkAtChar(row, (oldTo > from) ? oldTo - 1 : from);
+    int start = row->chunks[first].charStart;
+    int end = ((last + 1 < row->numChunks) ? row->chunks[last + 1].charStart : oldSize) + shift;
+    while(end - start < kRowChunkSize / 2 && (first > 0 || last + 1 < row->numChunks)){
+        if(last + 1 < row->numChunks){
+            last++;
+            end = ((last + 1 < row->numChunks) ? row->chunks[last + 1].charStart : oldSize) + shift;
+        }
+        else{
+            start = row->chunks[--first].charStart;
+        }
+    }
+    
+    int renderX = row->chunks[first].renderStart;
+    int count = ((end - start) / kRowChunkSize > 1) ? (end - start) / kRowChunkSize : 1;
+    int tail = row->numChunks - last - 1;
+    int numChunks = first + count + tail;
+    if(numChunks > row->numChunks)
+        row->chunks = editorRealloc(MEM_CHUNKS, row->chunks, sizeof(editorRowChunk) * numChunks);
+    memmove(&row->chunks[first + count], &row->chunks[last + 1], sizeof(editorRowChunk) * tail);
+    if(numChunks < row->numChunks)
+        row->chunks = editorRealloc(MEM_CHUNKS, row->chunks, sizeof(editorRowChunk) * numChunks);
+    row->numChunks = numChunks;
+    for(int k = first + count; k < numChunks; k++)
+        row->chunks[k].charStart += shift;
+    
+    if(!editorRowCutChunks(row, first, start, end, count, &renderX)){
+        // The edit left a char running into the next chunk
+        editorUpdateRowRender(row);
+        return;
+    }
+    
+    // Later chunks move by the change in width until a tab takes all of it
+    // but whole tab stops, so at most the chunk with that tab is counted again
+    int k = first + count;
+    while(k < numChunks && (renderX - row->chunks[k].renderStart) % kTabStop){
+        int oldEnd = (k + 1 < numChunks) ? row->chunks[k + 1].renderStart : row->renderSize;
+        int delta = renderX - row->chunks[k].renderStart;
+        row->chunks[k].renderStart = renderX;
+        if(row->chunks[k].tabs){
+            int j = row->chunks[k].charStart;
+            int chunkEnd = editorRowChunkEnd(row, k);
+            while(j < chunkEnd)
+                renderX = editorNextColumn(row->chars, row->size, &j, renderX);
+        }
+        else{
+            renderX = oldEnd + delta;
+        }
+        k++;
+    }
+    if(k < numChunks){
+        int delta = renderX - row->chunks[k].renderStart;
+        for(; k < numChunks; k++)
+            row->chunks[k].renderStart += delta;
+        row->renderSize += delta;
+    }
+    else{
+        row->renderSize = renderX;
+    }
+    editorRowChunksChanged(row);
+}
+
+// Rebuilds the render of a row after an edit that turned chars [from, oldTo)
+// into [from, newTo), rescanning only the chunks it touched on long rows
+void editorUpdateRowRenderSpan(editorRow *row, int from, int oldTo, int newTo){
+    if(row->numChunks && row->size > kRowChunkSize)
+        editorRowRechunk(row, from, oldTo, newTo);
+    else
+        editorUpdateRowRender(row);
+}
+
+void editorUpdateRowSpan(editorRow *row, int from, int oldTo, int newTo){
+    editorWordsUpdate(row);
+    row->pageOffset = -1;
+    editorUpdateRowRenderSpan(row, from, oldTo, newTo);
+    editorUpdateSyntax(row);
+}
+
+// Fills in a row holding a copy of s, with no render or highlighting yet
+// A NULL s leaves the row paged out, for the caller to set where it is read from
+void editorInitRow(editorRow *row, int index, const char *s, size_t len){
+    row->index = index;
+    
+    row->size = len;
+    row->chars = NULL;
+    if(s){
+        row->chars = editorCharsAlloc(len + 1);
+        memcpy(row->chars, s, len);
+        row->chars[len] = '\0';
+    }
+    
+    row->renderSize = 0;
+    row->plain = 1;
+    row->render = NULL;
+    row->hlRuns = NULL;
+    row->numHlRuns = 0;
+    row->hlOpenComment = 0;
+    row->hlStale = 0;
+    row->chunks = NULL;
+    row->numChunks = 0;
+    editorBracketsClear(&row->brackets);
+    row->pageOffset = -1;
+    row->pageSpilled = 0;
+}
+
+void editorInsertRow(int pos, char *s, size_t len){
+    if(pos < 0 || pos > EditorConfig.numRows)
+        return;
+    
+    if(EditorConfig.numRows == EditorConfig.rowsCapacity){
+        EditorConfig.rowsCapacity = EditorConfig.rowsCapacity ? EditorConfig.rowsCapacity * 2 : 16;
+        EditorConfig.rows = editorRealloc(MEM_ROWS, EditorConfig.rows, sizeof(editorRow) * EditorConfig.rowsCapacity);
+    }
+    memmove(&EditorConfig.rows[pos + 1], &EditorConfig.rows[pos], sizeof(editorRow) * (EditorConfig.numRows - pos));
+    for(int j = pos + 1; j <= EditorConfig.numRows; j++)
+        EditorConfig.rows[j].index++;
+    editorFoldsShift(pos, 1);
+    editorPageShift(pos, 1);
+    
+    editorInitRow(&EditorConfig.rows[pos], pos, s, len);
+    editorBracketTreeInsert(pos);
+    editorPageTouch(pos);
+    editorUpdateRow(&EditorConfig.rows[pos]);
+    
+    EditorConfig.numRows++;
+    EditorConfig.dirtyFlag++;
+    EditorConfig.version++;
+    editorJournalRecord(JOURNAL_INSERT_ROW, pos, 0, s, len);
+}
+
+// Gives the row a payload of its own before it is written in place
+void editorRowUnshare(editorRow *row){
+    if(TEXT_HEADER(row->chars)->refs > 1)
+        row->chars = editorCharsResize(row->chars, row->size + 1, row->size + 1);
+}
+
+void editorRowInsertChar(editorRow *row, int pos, int c){
+    if(pos < 0 || pos > row->size)
+        pos = row->size;
+    editorRowLoad(row);
+    row->chars = editorCharsResize(row->chars, row->size + 2, row->size + 1);
+    memmove(&row->chars[pos + 1], &row->chars[pos], row->size - pos + 1);
+    row->size++;
+    row->chars[pos] = c;
+    editorUpdateRowSpan(row, pos, pos, pos + 1);
+    EditorConfig.dirtyFlag++;
+    EditorConfig.version++;
+    char byte = c;
+    editorJournalRecord(JOURNAL_INSERT_CHAR, row->index, pos, &byte, 1);
+}
+
+void editorRowDelChar(editorRow *row, int pos){
     if(pos < 0 || pos >= row->size)
         return;
-    memmove(&row->chars[pos], &row->chars[pos + 1], row->size - pos);
-    row->size--;
-    editorUpdateRow(row);
-    EditorConfig.dirtyFlag++;
+    editorRowLoad(row);
+    editorRowUnshare(row);
+    memmove(&row->chars[pos], &row->chars[pos + 1], row->size - pos);
+    row->size--;
+    editorUpdateRowSpan(row, pos, pos + 1, pos);
+    EditorConfig.dirtyFlag++;
+    EditorConfig.version++;
+    editorJournalRecord(JOURNAL_DELETE_CHAR, row->index, pos, NULL, 0);
+}
+
+void editorFreeRow(editorRow *row){
+    editorWordsRemoveRow(row);
+    editorFree(MEM_RENDER, row->render);
+    editorCharsRelease(row->chars);
+    editorFree(MEM_HIGHLIGHT, row->hlRuns);
+    editorFree(MEM_CHUNKS, row->chunks);
+}
+
+void editorDelRow(int pos){
+    if(pos < 0 || pos >= EditorConfig.numRows)
+        return;
+    if(WordIndex.built)
+        editorRowPeek(&EditorConfig.rows[pos]); // Its words leave the index from its render
+    editorFreeRow(&EditorConfig.rows[pos]);
+    memmove(&EditorConfig.rows[pos], &EditorConfig.rows[pos + 1], sizeof(editorRow) * (EditorConfig.numRows - pos - 1));
+    for(int j = pos; j < EditorConfig.numRows - 1; j++)
+        EditorConfig.rows[j].index--;
+    EditorConfig.numRows--;
+    editorBracketTreeDelete(pos);
+    editorFoldsShift(pos, -1);
+    editorPageShift(pos, -1);
+    EditorConfig.dirtyFlag++;
+    EditorConfig.version++;
+    editorJournalRecord(JOURNAL_DELETE_ROW, pos, 0, NULL, 0);
+}
+
+void editorRowAppendString(editorRow *row, char *s, size_t len){
+    editorRowLoad(row);
+    row->chars = editorCharsResize(row->chars, row->size + len + 1, row->size);
+    memcpy(&row->chars[row->size], s, len);
+    row->size += len;
+    row->chars[row->size] = '\0';
+    editorUpdateRowSpan(row, row->size - len, row->size - len, row->size);
+    EditorConfig.dirtyFlag++;
+    EditorConfig.version++;
+    editorJournalRecord(JOURNAL_APPEND, row->index, 0, s, len);
+}
+
+void editorRowTruncate(editorRow *row, int size){
+    if(size < 0 || size >= row->size)
+        return;
+    editorRowLoad(row);
+    editorRowUnshare(row);
+    int oldSize = row->size;
+    row->size = size;
+    row->chars[row->size] = '\0';
+    editorUpdateRowSpan(row, size, oldSize, size);
+    EditorConfig.version++;
+    editorJournalRecord(JOURNAL_TRUNCATE, row->index, size, NULL, 0);
+}
+
+// Replaces the contents of a row with chars, which the row takes ownership of.
+// Highlighting is left to the caller so consecutive rows can share one pass.
+// chars must come from editorCharsAlloc.
+void editorRowSetChars(editorRow *row, char *chars, int size){
+    editorRowLoad(row);
+    // Long rows are cut again only around the part that differs
+    int from = 0;
+    int oldTo = row->size;
+    int newTo = size;
+    if(row->numChunks){
+        while(from < oldTo && from < newTo && row->chars[from] == chars[from])
+            from++;
+        while(oldTo > from && newTo > from && row->chars[oldTo - 1] == chars[newTo - 1]){
+            oldTo--;
+            newTo--;
+        }
+    }
+    editorCharsRelease(row->chars);
+    row->chars = chars;
+    row->size = size;
+    row->chars[size] = '\0';
+    editorWordsUpdate(row);
+    row->pageOffset = -1;
+    editorUpdateRowRenderSpan(row, from, oldTo, newTo);
+    EditorConfig.dirtyFlag++;
+    EditorConfig.version++;
+    editorJournalRecord(JOURNAL_SET_ROW, row->index, 0, chars, size);
+}
+
+///// EDITOR OPERATIONS /////
+
+void editorInsertChar(int c){
+    if(EditorConfig.cursorY == EditorConfig.numRows)
+        editorInsertRow(EditorConfig.numRows, "", 0);
+    editorRowInsertChar(&EditorConfig.rows[EditorConfig.cursorY], EditorConfig.cursorX, c);
+    EditorConfig.cursorX++;
+}
+
+void editorDelChar(){
+    if(EditorConfig.cursorY == EditorConfig.numRows)
+        return;
+    if(EditorConfig.cursorX == 0 && EditorConfig.cursorY == 0)
+        return;
+    
+    editorRow *row = &EditorConfig.rows[EditorConfig.cursorY];
+    editorRowLoad(row);
+    if(EditorConfig.cursorX > 0){
+        int start = utf8PrevChar(row->chars, EditorConfig.cursorX);
+        while(EditorConfig.cursorX > start)
+            editorRowDelChar(row, --EditorConfig.cursorX);
+    }
+    else{
+        EditorConfig.cursorX = EditorConfig.rows[EditorConfig.cursorY - 1].size;
+        editorRowAppendString(&EditorConfig.rows[EditorConfig.cursorY - 1], row->chars, row->size);
+        editorDelRow(EditorConfig.cursorY--);
+    }
+}
+
+void editorInsertNewLine(){
+    if(EditorConfig.cursorX == 0)
+        editorInsertRow(EditorConfig.cursorY, "", 0);
+    else{
+        editorRowLoad(&EditorConfig.rows[EditorConfig.cursorY]);
+        editorRow *row = &EditorConfig.rows[EditorConfig.cursorY];
+        editorInsertRow(EditorConfig.cursorY + 1, &row->chars[EditorConfig.cursorX], row->size - EditorConfig.cursorX);
+        editorRowTruncate(&EditorConfig.rows[EditorConfig.cursorY], EditorConfig.cursorX);
+    }
+    EditorConfig.cursorY++;
+    EditorConfig.cursorX = 0;
+}
+
+///// WORD COMPLETION /////
+
+int editorIsWordChar(int c){
+    return isalnum(c) || c == '_' || c >= 0x80;
+}
+
+// Child of node for byte c, created if asked; -1 when missing
+int editorWordChild(int node, unsigned char c, int create){
+    int *link = &WordIndex.nodes[node].child;
+    while(*link != -1 && WordIndex.nodes[*link].c < c)
+        link = &WordIndex.nodes[*link].sibling;
+    if(*link != -1 && WordIndex.nodes[*link].c == c)
+        return *link;
+    if(!create)
+        return -1;
+    
+    if(WordIndex.numNodes == WordIndex.nodesCapacity){
+        // Growing may move the node holding link
+        ptrdiff_t offset = (char *)link - (char *)WordIndex.nodes;
+        WordIndex.nodesCapacity *= 2;
+        WordIndex.nodes = editorRealloc(MEM_WORDS, WordIndex.nodes, sizeof(editorWordNode) * WordIndex.nodesCapacity);
+        link = (int *)((char *)WordIndex.nodes + offset);
+    }
+    int child = WordIndex.numNodes++;
+    WordIndex.nodes[child].child = -1;
+    WordIndex.nodes[child].sibling = *link;
+    WordIndex.nodes[child].count = 0;
+    WordIndex.nodes[child].c = c;
+    *link = child;
+    return child;
+}
+
+// Adds delta occurrences of a word. Nodes of words that drop to zero stay,
+// ready for the word to come back.
+void editorWordsAdjust(const char *word, int length, int delta){
+    if(length < kWordMinLength || length > WORD_MAX_LENGTH || isdigit((unsigned char)word[0]))
+        return;
+    int node = 0;
+    for(int i = 0; i < length && node != -1; i++)
+        node = editorWordChild(node, word[i], delta > 0);
+    if(node != -1)
+        WordIndex.nodes[node].count += delta;
+}
+
+// Splits s into words, leaving them in *spans
+int editorWordsSplit(const char *s, int length, editorWordSpan **spans, int *capacity){
+    int count = 0;
+    int i = 0;
+    while(i < length){
+        while(i < length && !editorIsWordChar((unsigned char)s[i]))
+            i++;
+        int start = i;
+        while(i < length && editorIsWordChar((unsigned char)s[i]))
+            i++;
+        if(i == start)
+            break;
+        if(count == *capacity){
+            *capacity = *capacity ? *capacity * 2 : 64;
+            *spans = editorRealloc(MEM_WORDS, *spans, sizeof(editorWordSpan) * *capacity);
+        }
+        (*spans)[count].start = start;
+        (*spans)[count].length = i - start;
+        count++;
+    }
+    return count;
+}
+
+void editorWordsAdjustText(const char *s, int length, int delta){
+    int count = editorWordsSplit(s, length, &WordIndex.oldWords, &WordIndex.oldCapacity);
+    for(int w = 0; w < count; w++)
+        editorWordsAdjust(&s[WordIndex.oldWords[w].start], WordIndex.oldWords[w].length, delta);
+}
+
+// Text whose words a row contributes: its full render, which still holds the
+// previous contents while the row is being updated. Chunked rows have none.
+int editorWordsRowText(editorRow *row, char **text){
+    if(row->numChunks || !row->render)
+        return -1;
+    *text = row->render;
+    return row->renderLength;
+}
+
+// Called before the render of row is rebuilt: trades the words of the old
+// render for those of the new chars, skipping the words both share at either end
+void editorWordsUpdate(editorRow *row){
+    if(!WordIndex.built)
+        return;
+    char *old = NULL;
+    int oldLength = editorWordsRowText(row, &old);
+    int newLength = (row->size > kRowChunkSize) ? -1 : row->size;
+    
+    int oldCount = (oldLength == -1) ? 0 : editorWordsSplit(old, oldLength, &WordIndex.oldWords, &WordIndex.oldCapacity);
+    int newCount = (newLength == -1) ? 0 : editorWordsSplit(row->chars, newLength, &WordIndex.newWords, &WordIndex.newCapacity);
+    editorWordSpan *a = WordIndex.oldWords;
+    editorWordSpan *b = WordIndex.newWords;
+    
+    int first = 0;
+    while(first < oldCount && first < newCount && a[first].length == b[first].length &&
+          !memcmp(&old[a[first].start], &row->chars[b[first].start], a[first].length))
+        first++;
+    while(oldCount > first && newCount > first && a[oldCount - 1].length == b[newCount - 1].length &&
+          !memcmp(&old[a[oldCount - 1].start], &row->chars[b[newCount - 1].start], a[oldCount - 1].length)){
+        oldCount--;
+        newCount--;
+    }
+    for(int w = first; w < oldCount; w++)
+        editorWordsAdjust(&old[a[w].start], a[w].length, -1);
+    for(int w = first; w < newCount; w++)
+        editorWordsAdjust(&row->chars[b[w].start], b[w].length, 1);
+}
+
+void editorWordsRemoveRow(editorRow *row){
+    char *text;
+    int length;
+    if(WordIndex.built && (length = editorWordsRowText(row, &text)) != -1)
+        editorWordsAdjustText(text, length, -1);
+}
+
+// Indexes every row the first time completion is used
+void editorWordsBuild(){
+    if(WordIndex.built)
+        return;
+    WordIndex.nodesCapacity = 1024;
+    WordIndex.nodes = editorMalloc(MEM_WORDS, sizeof(editorWordNode) * WordIndex.nodesCapacity);
+    WordIndex.nodes[0].child = -1;
+    WordIndex.nodes[0].sibling = -1;
+    WordIndex.nodes[0].count = 0;
+    WordIndex.numNodes = 1;
+    for(int j = 0; j < EditorConfig.numRows; j++){
+        editorRow *row = &EditorConfig.rows[j];
+        int paged = editorRowPeek(row);
+        if(!row->numChunks)
+            editorWordsAdjustText(row->chars, row->size, 1);
+        if(paged)
+            editorRowEvict(row);
+    }
+    WordIndex.built = 1;
+}
+
+void editorWordsClear(){
+    editorFree(MEM_WORDS, WordIndex.nodes);
+    WordIndex.nodes = NULL;
+    WordIndex.numNodes = 0;
+    WordIndex.built = 0;
+    WordIndex.cycling = 0;
+}
+
+// Keeps the most frequent words under node, word holding depth bytes
+void editorWordsCollect(int node, char *word, int depth){
+    int count = WordIndex.nodes[node].count;
+    if(count > 0 && depth > WordIndex.prefixLength){
+        int pos = WordIndex.numCandidates;
+        while(pos > 0 && WordIndex.candidateCounts[pos - 1] < count)
+            pos--;
+        if(pos < COMPLETE_MAX_CANDIDATES){
+            int last = (WordIndex.numCandidates < COMPLETE_MAX_CANDIDATES) ? WordIndex.numCandidates++ : COMPLETE_MAX_CANDIDATES - 1;
+            for(int k = last; k > pos; k--){
+                memcpy(WordIndex.candidates[k], WordIndex.candidates[k - 1], sizeof(WordIndex.candidates[k]));
+                WordIndex.candidateCounts[k] = WordIndex.candidateCounts[k - 1];
+            }
+            memcpy(WordIndex.candidates[pos], word, depth);
+            WordIndex.candidates[pos][depth] = '\0';
+            WordIndex.candidateCounts[pos] = count;
+        }
+    }
+    for(int child = WordIndex.nodes[node].child; child != -1; child = WordIndex.nodes[child].sibling){
+        word[depth] = WordIndex.nodes[child].c;
+        editorWordsCollect(child, word, depth + 1);
+    }
+}
+
+// Fills the candidates with the most frequent longer words starting with prefix
+int editorWordsQuery(const char *prefix, int length){
+    editorWordsBuild();
+    WordIndex.numCandidates = 0;
+    WordIndex.prefixLength = length;
+    if(length > WORD_MAX_LENGTH)
+        return 0;
+    int node = 0;
+    for(int i = 0; i < length && node != -1; i++)
+        node = editorWordChild(node, prefix[i], 0);
+    if(node == -1)
+        return 0;
+    char word[WORD_MAX_LENGTH + 1];
+    memcpy(word, prefix, length);
+    editorWordsCollect(node, word, length);
+    return WordIndex.numCandidates;
+}
+
+// Start of the word that ends at the cursor, or -1 inside a word
+int editorWordStart(){
+    editorRow *row = &EditorConfig.rows[EditorConfig.cursorY];
+    editorRowLoad(row);
+    if(EditorConfig.cursorX < row->size && editorIsWordChar((unsigned char)row->chars[EditorConfig.cursorX]))
+        return -1;
+    int start = EditorConfig.cursorX;
+    while(start > 0 && editorIsWordChar((unsigned char)row->chars[start - 1]))
+        start--;
+    return start;
+}
+
+void editorCompleteShow(){
+    char msg[sizeof(EditorConfig.statusMsg)];
+    int len = snprintf(msg, sizeof(msg), "Ctrl-N:");
+    for(int k = 0; k < WordIndex.numCandidates && len < (int)sizeof(msg); k++){
+        int selected = WordIndex.cycling && k == WordIndex.selected;
+        len += snprintf(&msg[len], sizeof(msg) - len, selected ? " [%s]" : " %s", WordIndex.candidates[k]);
+    }
+    editorSetStatusMessage("%s", msg);
+}
+
+// Lists the completions of the word being typed in the message bar
+void editorCompleteHint(){
+    if(EditorConfig.cursorY >= EditorConfig.numRows || EditorConfig.numCursors || EditorConfig.blockActive)
+        return;
+    int start = editorWordStart();
+    int length = EditorConfig.cursorX - start;
+    if(start != -1 && length >= kWordMinLength && editorWordsQuery(&EditorConfig.rows[EditorConfig.cursorY].chars[start], length)){
+        editorCompleteShow();
+        WordIndex.hintShown = 1;
+    }
+    else if(WordIndex.hintShown){
+        editorSetStatusMessage("");
+        WordIndex.hintShown = 0;
+    }
+}
+
+// Completes the word before the cursor; pressing again swaps in the next candidate
+void editorComplete(){
+    if(EditorConfig.cursorY >= EditorConfig.numRows)
+        return;
+    editorRow *row = &EditorConfig.rows[EditorConfig.cursorY];
+    
+    if(!WordIndex.cycling){
+        int start = editorWordStart();
+        int length = EditorConfig.cursorX - start;
+        if(start == -1 || length == 0){
+            editorSetStatusMessage("No word ends at the cursor");
+            return;
+        }
+        if(!editorWordsQuery(&row->chars[start], length)){
+            editorSetStatusMessage("No completions");
+            return;
+        }
+        WordIndex.cycling = 1;
+        WordIndex.selected = 0;
+        WordIndex.inserted = 0;
+    }
+    else
+        WordIndex.selected = (WordIndex.selected + 1) % WordIndex.numCandidates;
+    
+    // The row is rebuilt once, swapping the previous candidate's tail for this one's
+    editorRowLoad(row);
+    char *word = &WordIndex.candidates[WordIndex.selected][WordIndex.prefixLength];
+    int wordLength = strlen(word);
+    int start = EditorConfig.cursorX - WordIndex.inserted;
+    int size = row->size - WordIndex.inserted + wordLength;
+    char *chars = editorCharsAlloc(size + 1);
+    memcpy(chars, row->chars, start);
+    memcpy(&chars[start], word, wordLength);
+    memcpy(&chars[start + wordLength], &row->chars[EditorConfig.cursorX], row->size - EditorConfig.cursorX);
+    editorRowSetChars(row, chars, size);
+    editorUpdateSyntax(row);
+    EditorConfig.cursorX = start + wordLength;
+    WordIndex.inserted = wordLength;
+    editorCompleteShow();
+    WordIndex.hintShown = 1;
+}
+
+///// MULTI-CURSOR /////
+
+// Render column of the primary cursor, which renderX only holds after a refresh
+int editorCursorRenderX(){
+    if(EditorConfig.cursorY >= EditorConfig.numRows)
+        return 0;
+    editorRowLoad(&EditorConfig.rows[EditorConfig.cursorY]);
+    return editorRowCursorToRender(&EditorConfig.rows[EditorConfig.cursorY], EditorConfig.cursorX);
+}
+
+void editorClearCursors(){
+    EditorConfig.numCursors = 0;
+    EditorConfig.blockActive = 0;
+}
+
+// Rows of the block selection and its render columns [left, right)
+void editorBlockRect(int *top, int *bottom, int *left, int *right){
+    *top = EditorConfig.blockAnchorY < EditorConfig.cursorY ? EditorConfig.blockAnchorY : EditorConfig.cursorY;
+    *bottom = EditorConfig.blockAnchorY > EditorConfig.cursorY ? EditorConfig.blockAnchorY : EditorConfig.cursorY;
+    int renderX = editorCursorRenderX();
+    *left = EditorConfig.blockAnchorX < renderX ? EditorConfig.blockAnchorX : renderX;
+    *right = EditorConfig.blockAnchorX > renderX ? EditorConfig.blockAnchorX : renderX;
+    if(*bottom >= EditorConfig.numRows)
+        *bottom = EditorConfig.numRows - 1;
+}
+
+void editorToggleBlock(){
+    EditorConfig.numCursors = 0;
+    EditorConfig.blockActive = !EditorConfig.blockActive;
+    if(EditorConfig.blockActive){
+        EditorConfig.blockAnchorX = editorCursorRenderX();
+        EditorConfig.blockAnchorY = EditorConfig.cursorY;
+        editorSetStatusMessage("Block selection: move to extend, type to edit every row, ESC to cancel");
+    }
+}
+
+void editorAddCursorBelow(){
+    EditorConfig.blockActive = 0;
+    int lowest = EditorConfig.cursorY;
+    for(int i = 0; i < EditorConfig.numCursors; i++)
+        if(EditorConfig.cursors[i].y > lowest)
+            lowest = EditorConfig.cursors[i].y;
+    if(lowest + 1 >= EditorConfig.numRows)
+        return;
+    
+    // New cursors line up with the primary one on screen
+    editorRow *row = &EditorConfig.rows[lowest + 1];
+    editorRowLoad(row);
+    EditorConfig.cursors = realloc(EditorConfig.cursors, sizeof(editorCursor) * (EditorConfig.numCursors + 1));
+    EditorConfig.cursors[EditorConfig.numCursors].x = editorRowRenderToCursor(row, editorCursorRenderX());
+    EditorConfig.cursors[EditorConfig.numCursors].y = lowest + 1;
+    EditorConfig.numCursors++;
+    editorSetStatusMessage("%d cursors", EditorConfig.numCursors + 1);
+}
+
+int editorRowEditCompare(const void *a, const void *b){
+    return ((const editorRowEdit *)a)->y - ((const editorRowEdit *)b)->y;
+}
+
+// One edit per row holding a cursor or part of the block, sorted by row
+int editorCollectEdits(editorRowEdit **edits){
+    int count = 0;
+    if(EditorConfig.blockActive){
+        int top, bottom, left, right;
+        editorBlockRect(&top, &bottom, &left, &right);
+        *edits = malloc(sizeof(editorRowEdit) * (bottom - top + 1));
+        for(int y = top; y <= bottom; y++){
+            editorRow *row = &EditorConfig.rows[y];
+            editorRowLoad(row);
+            (*edits)[count].y = y;
+            (*edits)[count].from = editorRowRenderToCursor(row, left);
+            (*edits)[count].to = editorRowRenderToCursor(row, right);
+            count++;
+        }
+        return count;
+    }
+    
+    *edits = malloc(sizeof(editorRowEdit) * (EditorConfig.numCursors + 1));
+    for(int i = -1; i < EditorConfig.numCursors; i++){
+        editorCursor cursor = {EditorConfig.cursorX, EditorConfig.cursorY};
+        if(i >= 0)
+            cursor = EditorConfig.cursors[i];
+        if(cursor.y >= EditorConfig.numRows)
+            continue;
+        editorRow *row = &EditorConfig.rows[cursor.y];
+        editorRowLoad(row);
+        if(cursor.x > row->size)
+            cursor.x = row->size;
+        (*edits)[count].y = cursor.y;
+        (*edits)[count].from = cursor.x;
+        (*edits)[count].to = cursor.x;
+        count++;
+    }
+    qsort(*edits, count, sizeof(editorRowEdit), editorRowEditCompare);
+    
+    // Cursors sharing a row collapse into one
+    int unique = 0;
+    for(int i = 0; i < count; i++)
+        if(unique == 0 || (*edits)[unique - 1].y != (*edits)[i].y)
+            (*edits)[unique++] = (*edits)[i];
+    return unique;
+}
+
+// Replaces each edit range with s. Every row is rebuilt once and each run of
+// consecutive rows is highlighted once; cursors end up after the inserted text.
+void editorApplyEdits(editorRowEdit *edits, int count, const char *s, int len){
+    int regionStart = 0;
+    for(int i = 0; i < count; i++){
+        editorRow *row = &EditorConfig.rows[edits[i].y];
+        editorRowLoad(row);
+        if(edits[i].from != edits[i].to || len){
+            int size = row->size - (edits[i].to - edits[i].from) + len;
+            char *chars = editorCharsAlloc(size + 1);
+            memcpy(chars, row->chars, edits[i].from);
+            memcpy(&chars[edits[i].from], s, len);
+            memcpy(&chars[edits[i].from + len], &row->chars[edits[i].to], row->size - edits[i].to);
+            editorRowSetChars(row, chars, size);
+        }
+        if(i + 1 == count || edits[i + 1].y != edits[i].y + 1){
+            editorUpdateSyntaxRange(&EditorConfig.rows[edits[regionStart].y], edits[i].y);
+            regionStart = i + 1;
+        }
+    }
+    
+    EditorConfig.blockActive = 0;
+    EditorConfig.cursors = realloc(EditorConfig.cursors, sizeof(editorCursor) * count);
+    EditorConfig.numCursors = 0;
+    for(int i = 0; i < count; i++){
+        editorCursor cursor = {edits[i].from + len, edits[i].y};
+        if(cursor.y == EditorConfig.cursorY)
+            EditorConfig.cursorX = cursor.x;
+        else
+            EditorConfig.cursors[EditorConfig.numCursors++] = cursor;
+    }
+}
+
+void editorMoveCursors(int key){
+    for(int i = -1; i < EditorConfig.numCursors; i++){
+        editorCursor *cursor = (i >= 0) ? &EditorConfig.cursors[i] : NULL;
+        int y = cursor ? cursor->y : EditorConfig.cursorY;
+        int x = cursor ? cursor->x : EditorConfig.cursorX;
+        if(y >= EditorConfig.numRows)
+            continue;
+        editorRow *row = &EditorConfig.rows[y];
+        editorRowLoad(row);
+        if(x > row->size)
+            x = row->size;
+        if(key == ARROW_LEFT)
+            x = utf8PrevChar(row->chars, x);
+        else if(key == ARROW_RIGHT)
+            x = utf8NextChar(row->chars, row->size, x);
+        else if(key == HOME_KEY)
+            x = 0;
+        else if(key == END_KEY)
+            x = row->size;
+        if(cursor)
+            cursor->x = x;
+        else
+            EditorConfig.cursorX = x;
+    }
+}
+
+// Applies a key to every cursor or to the block. Returns 0 for keys that
+// should go through the normal single cursor handling.
+int editorMultiCursorKey(int c){
+    if(EditorConfig.numCursors == 0 && !EditorConfig.blockActive)
+        return 0;
+    
+    switch(c){
+        case BACKSPACE:
+        case CTRL_KEY('h'):
+        case DEL_KEY:
+            {
+                editorRowEdit *edits;
+                int count = editorCollectEdits(&edits);
+                for(int i = 0; i < count; i++){
+                    if(edits[i].from != edits[i].to)
+                        continue;
+                    editorRow *row = &EditorConfig.rows[edits[i].y];
+                    if(c == DEL_KEY)
+                        edits[i].to = utf8NextChar(row->chars, row->size, edits[i].to);
+                    else
+                        edits[i].from = utf8PrevChar(row->chars, edits[i].from);
+                }
+                editorApplyEdits(edits, count, "", 0);
+                free(edits);
+            }
+            return 1;
+        
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+        case HOME_KEY:
+        case END_KEY:
+            if(EditorConfig.blockActive)
+                return 0;
+            editorMoveCursors(c);
+            return 1;
+        
+        case '\r':
+        case ARROW_UP:
+        case ARROW_DOWN:
+        case PAGE_UP:
+        case PAGE_DOWN:
+            if(EditorConfig.blockActive && c != '\r')
+                return 0;
+            editorClearCursors();
+            return 0;
+            
+        default:
+            if(c == '\t' || (c < 256 && (c >= 128 || !iscntrl(c)))){
+                char ch = c;
+                editorRowEdit *edits;
+                int count = editorCollectEdits(&edits);
+                editorApplyEdits(edits, count, &ch, 1);
+                free(edits);
+                return 1;
+            }
+            return 0;
+    }
+}
+
+///// CACHE /////
+
+// Line index and comment states of large files, kept between sessions so a
+// reopen neither splits lines nor lexes the whole file
+typedef struct editorCacheHeader {
+    char magic[8];
+    uint64_t size;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint64_t contentHash;
+    uint64_t syntaxHash;
+    uint64_t numRows;
+    uint64_t trailingNewline;
+} editorCacheHeader;
+
+// Followed by uint64_t starts[numRows] and uint32_t lengths[numRows], where
+// the top bit of a length holds hlOpenComment
+
+uint64_t editorHash(uint64_t hash, const void *data, size_t len){
+    const unsigned char *p = data;
+    for(size_t i = 0; i < len; i++){
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL; // FNV-1a
+    }
+    return hash;
+}
+
+// Hashes the size and the first and last kCacheSample bytes of the file
+uint64_t editorCacheContentHash(const char *data, size_t size){
+    uint64_t hash = editorHash(0xcbf29ce484222325ULL, &size, sizeof(size));
+    size_t head = size < kCacheSample ? size : kCacheSample;
+    hash = editorHash(hash, data, head);
+    if(size > head){
+        size_t tail = (size - head < kCacheSample) ? size - head : kCacheSample;
+        hash = editorHash(hash, &data[size - tail], tail);
+    }
+    return hash;
+}
+
+// Comment states depend on the delimiters of the syntax in use
+uint64_t editorCacheSyntaxHash(){
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    struct editorSyntax *syntax = EditorConfig.syntax;
+    if(syntax == NULL)
+        return hash;
+    hash = editorHash(hash, syntax->fileType, strlen(syntax->fileType) + 1);
+    if(syntax->multiLineCommentStart)
+        hash = editorHash(hash, syntax->multiLineCommentStart, strlen(syntax->multiLineCommentStart) + 1);
+    if(syntax->multiLineCommentEnd)
+        hash = editorHash(hash, syntax->multiLineCommentEnd, strlen(syntax->multiLineCommentEnd) + 1);
+    if(syntax->singleLineCommentStart)
+        hash = editorHash(hash, syntax->singleLineCommentStart, strlen(syntax->singleLineCommentStart) + 1);
+    return editorHash(hash, &syntax->flags, sizeof(syntax->flags));
+}
+
+// $XDG_CACHE_HOME/kbeditor/<hash of the absolute path>, creating the directory
+int editorCachePath(char *buf, size_t size, const char *fileName){
+    char absolute[PATH_MAX];
+    if(realpath(fileName, absolute) == NULL)
+        return 0;
+    
+    char dir[1024];
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if(xdg && xdg[0])
+        snprintf(dir, sizeof(dir), "%s", xdg);
+    else if(home)
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    else
+        return 0;
+    mkdir(dir, 0700);
+    strncat(dir, "/kbeditor", sizeof(dir) - strlen(dir) - 1);
+    mkdir(dir, 0700);
+    
+    uint64_t hash = editorHash(0xcbf29ce484222325ULL, absolute, strlen(absolute));
+    snprintf(buf, size, "%s/%016llx", dir, (unsigned long long)hash);
+    return 1;
+}
+
+// Loads the rows of fd from a valid cache, skipping the split into lines.
+// Under a memory budget rows start paged out and are read from the file when
+// first used; otherwise they are copied, since another process rewriting the
+// file would change rows read later. Highlighting is left stale and done per
+// row when drawn, starting from the cached comment states.
+int editorCacheLoad(int fd, struct stat *st){
+    char path[1100];
+    if(st->st_size < kCacheMinSize || !editorCachePath(path, sizeof(path), EditorConfig.filename))
+        return 0;
+    int cacheFd = open(path, O_RDONLY | O_CLOEXEC);
+    if(cacheFd == -1)
+        return 0;
+    struct stat cacheSt;
+    if(fstat(cacheFd, &cacheSt) == -1 || (size_t)cacheSt.st_size < sizeof(editorCacheHeader)){
+        close(cacheFd);
+        return 0;
+    }
+    char *cache = mmap(NULL, cacheSt.st_size, PROT_READ, MAP_PRIVATE, cacheFd, 0);
+    close(cacheFd);
+    if(cache == MAP_FAILED)
+        return 0;
+    
+    editorCacheHeader *header = (editorCacheHeader *)cache;
+    int valid = !memcmp(header->magic, "KBCACHE1", 8) &&
+                header->size == (uint64_t)st->st_size &&
+                header->mtimeSec == st->st_mtim.tv_sec && header->mtimeNsec == st->st_mtim.tv_nsec &&
+                header->syntaxHash == editorCacheSyntaxHash() &&
+                header->numRows < INT_MAX &&
+                (size_t)cacheSt.st_size == sizeof(editorCacheHeader) + header->numRows * 12;
+    char *data = valid ? mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if(data == MAP_FAILED || header->contentHash != editorCacheContentHash(data, st->st_size)){
+        if(data != MAP_FAILED)
+            munmap(data, st->st_size);
+        munmap(cache, cacheSt.st_size);
+        return 0;
+    }
+    
+    int numRows = header->numRows;
+    uint64_t *starts = (uint64_t *)(cache + sizeof(editorCacheHeader));
+    uint32_t *lengths = (uint32_t *)(cache + sizeof(editorCacheHeader) + numRows * sizeof(uint64_t));
+    for(int j = 0; j < numRows; j++){
+        uint32_t length = lengths[j] & 0x7FFFFFFF;
+        if(starts[j] + length > (uint64_t)st->st_size){
+            numRows = j; // Torn cache; the file itself is intact
+            break;
+        }
+    }
+    
+    int paged = Paging.sourceFd != -1;
+    if(!paged)
+        madvise(data, st->st_size, MADV_SEQUENTIAL);
+    EditorConfig.rows = editorRealloc(MEM_ROWS, EditorConfig.rows, sizeof(editorRow) * numRows);
+    EditorConfig.rowsCapacity = numRows;
+    for(int j = 0; j < numRows; j++){
+        editorRow *row = &EditorConfig.rows[j];
+        uint32_t length = lengths[j] & 0x7FFFFFFF;
+        editorInitRow(row, j, paged ? NULL : &data[starts[j]], length);
+        if(paged)
+            row->pageOffset = starts[j];
+        else
+            editorUpdateRowRender(row);
+        row->hlOpenComment = lengths[j] >> 31;
+        row->hlStale = 1;
+    }
+    EditorConfig.numRows = numRows;
+    munmap(data, st->st_size);
+    EditorConfig.version++;
+    BracketTree.valid = 0;
+    EditorConfig.fileTrailingNewline = header->trailingNewline;
+    
+    munmap(cache, cacheSt.st_size);
+    return 1;
+}
+
+// Records the line index of a freshly loaded file; starts[j] is where row j begins on disk
+void editorCacheStore(struct stat *st, const uint64_t *starts){
+    char path[1100];
+    if(st->st_size < kCacheMinSize || !editorCachePath(path, sizeof(path), EditorConfig.filename))
+        return;
+    
+    int fd = open(EditorConfig.filename, O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+        return;
+    char *data = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+        return;
+    
+    editorCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "KBCACHE1", 8);
+    header.size = st->st_size;
+    header.mtimeSec = st->st_mtim.tv_sec;
+    header.mtimeNsec = st->st_mtim.tv_nsec;
+    header.contentHash = editorCacheContentHash(data, st->st_size);
+    header.syntaxHash = editorCacheSyntaxHash();
+    header.numRows = EditorConfig.numRows;
+    header.trailingNewline = EditorConfig.fileTrailingNewline;
+    munmap(data, st->st_size);
+    
+    uint32_t *lengths = malloc(sizeof(uint32_t) * EditorConfig.numRows);
+    for(int j = 0; j < EditorConfig.numRows; j++)
+        lengths[j] = EditorConfig.rows[j].size | ((uint32_t)EditorConfig.rows[j].hlOpenComment << 31);
+    
+    // Written aside and renamed so a reader never maps a partial cache
+    char tmp[1110];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(fd != -1){
+        int ok = write(fd, &header, sizeof(header)) == sizeof(header) &&
+                 write(fd, starts, sizeof(uint64_t) * EditorConfig.numRows) == (ssize_t)(sizeof(uint64_t) * EditorConfig.numRows) &&
+                 write(fd, lengths, sizeof(uint32_t) * EditorConfig.numRows) == (ssize_t)(sizeof(uint32_t) * EditorConfig.numRows);
+        close(fd);
+        if(ok)
+            rename(tmp, path);
+        else
+            unlink(tmp);
+    }
+    free(lengths);
+}
+
+///// SNAPSHOTS /////
+
+// Rows of the block starting at first are unchanged since it was taken. A
+// payload referenced by the block can't have been written in place, so
+// comparing pointers is enough, and so is comparing where paged out rows are.
+int editorSnapshotBlockMatches(editorSnapshotBlock *block, int first){
+    for(int j = 0; j < block->numRows; j++){
+        editorRow *row = &EditorConfig.rows[first + j];
+        editorSnapshotLine *line = &block->lines[j];
+        if(row->chars != line->chars || row->size != line->size)
+            return 0;
+        if(row->chars == NULL && (row->pageOffset != line->offset || row->pageSpilled != line->spilled))
+            return 0;
+    }
+    return 1;
+}
+
+void editorSnapshotBlockRelease(editorSnapshotBlock *block){
+    if(--block->refs)
+        return;
+    for(int j = 0; j < block->numRows; j++)
+        editorCharsRelease(block->lines[j].chars);
+    editorFree(MEM_SNAPSHOT, block);
+}
+
+// Shares every row payload of the buffer. Later edits copy the rows they
+// touch, so the snapshot stays as it was without locking the edit path.
+editorSnapshot *editorSnapshotTake(){
+    editorSnapshot *previous = EditorConfig.snapshot;
+    if(previous && previous->version == EditorConfig.version){
+        previous->refs++;
+        return previous;
+    }
+    
+    editorSnapshot *snapshot = editorMalloc(MEM_SNAPSHOT, sizeof(editorSnapshot));
+    snapshot->refs = 1;
+    snapshot->version = EditorConfig.version;
+    snapshot->numRows = EditorConfig.numRows;
+    snapshot->numBlocks = (EditorConfig.numRows + kSnapshotBlockRows - 1) / kSnapshotBlockRows;
+    snapshot->blocks = editorMalloc(MEM_SNAPSHOT, sizeof(editorSnapshotBlock *) * snapshot->numBlocks);
+    for(int b = 0; b < snapshot->numBlocks; b++){
+        int first = b * kSnapshotBlockRows;
+        int numRows = EditorConfig.numRows - first;
+        if(numRows > kSnapshotBlockRows)
+            numRows = kSnapshotBlockRows;
+        editorSnapshotBlock *block = (previous && b < previous->numBlocks) ? previous->blocks[b] : NULL;
+        if(block && block->numRows == numRows && editorSnapshotBlockMatches(block, first)){
+            block->refs++;
+            snapshot->blocks[b] = block;
+            continue;
+        }
+        
+        block = editorMalloc(MEM_SNAPSHOT, sizeof(editorSnapshotBlock) + sizeof(editorSnapshotLine) * numRows);
+        block->refs = 1;
+        block->numRows = numRows;
+        for(int j = 0; j < numRows; j++){
+            editorRow *row = &EditorConfig.rows[first + j];
+            block->lines[j].chars = row->chars ? editorCharsShare(row->chars) : NULL;
+            block->lines[j].size = row->size;
+            block->lines[j].offset = row->pageOffset;
+            block->lines[j].spilled = row->pageSpilled;
+        }
+        snapshot->blocks[b] = block;
+    }
+    
+    EditorConfig.snapshot = snapshot;
+    return snapshot;
+}
+
+void editorSnapshotRelease(editorSnapshot *snapshot){
+    if(--snapshot->refs)
+        return;
+    for(int b = 0; b < snapshot->numBlocks; b++)
+        editorSnapshotBlockRelease(snapshot->blocks[b]);
+    editorFree(MEM_SNAPSHOT, snapshot->blocks);
+    if(EditorConfig.snapshot == snapshot)
+        EditorConfig.snapshot = NULL;
+    editorFree(MEM_SNAPSHOT, snapshot);
+}
+
+///// PAGING /////
+
+size_t editorPagedBytes(){
+    return EditorMemory.bytes[MEM_CHARS] + EditorMemory.bytes[MEM_RENDER] +
+           EditorMemory.bytes[MEM_CHUNKS] + EditorMemory.bytes[MEM_HIGHLIGHT];
+}
+
+// Raises the last use of block b to use, tracking the block if it wasn't
+void editorPageUseBlock(int b, long long use){
+    if(b >= Paging.numBlocks){
+        int numBlocks = Paging.numBlocks ? Paging.numBlocks : 64;
+        while(numBlocks <= b)
+            numBlocks *= 2;
+        Paging.lastUse = editorRealloc(MEM_ROWS, Paging.lastUse, sizeof(long long) * numBlocks);
+        memset(&Paging.lastUse[Paging.numBlocks], 0, sizeof(long long) * (numBlocks - Paging.numBlocks));
+        Paging.numBlocks = numBlocks;
+    }
+    if(Paging.lastUse[b] == 0){
+        if(Paging.numLoaded == Paging.loadedCapacity){
+            Paging.loadedCapacity = Paging.loadedCapacity ? Paging.loadedCapacity * 2 : 64;
+            Paging.loaded = editorRealloc(MEM_ROWS, Paging.loaded, sizeof(int) * Paging.loadedCapacity);
+        }
+        Paging.loaded[Paging.numLoaded++] = b;
+    }
+    if(use > Paging.lastUse[b])
+        Paging.lastUse[b] = use;
+}
+
+void editorPageTouch(int y){
+    if(Paging.budget)
+        editorPageUseBlock(y / kPageBlockRows, ++Paging.tick);
+}
+
+// Inserting or deleting row pos moves one row of each later block into the
+// next or previous block, so the blocks loaded rows move into are tracked too.
+// Called before numRows changes.
+void editorPageShift(int pos, int delta){
+    int first = pos / kPageBlockRows;
+    int last = EditorConfig.numRows / kPageBlockRows;
+    int count = Paging.numLoaded;
+    for(int i = 0; i < count; i++){
+        int b = Paging.loaded[i];
+        if(b >= first && b + delta >= first && b + delta <= last)
+            editorPageUseBlock(b + delta, Paging.lastUse[b]);
+    }
+}
+
+// Created next to the file on first use and unlinked right away
+int editorPageSpillOpen(){
+    if(Paging.spillFd != -1)
+        return 1;
+    const char *fileName = EditorConfig.filename ? EditorConfig.filename : "untitled";
+    const char *slash = strrchr(fileName, '/');
+    char path[1100];
+    if(slash)
+        snprintf(path, sizeof(path), "%.*s.%s.kbspill-XXXXXX", (int)(slash - fileName + 1), fileName, slash + 1);
+    else
+        snprintf(path, sizeof(path), ".%s.kbspill-XXXXXX", fileName);
+    Paging.spillFd = mkostemp(path, O_CLOEXEC);
+    if(Paging.spillFd == -1)
+        return 0;
+    unlink(path);
+    Paging.spillSize = 0;
+    return 1;
+}
+
+// Reads a paged out row back and rebuilds its render; highlighting waits for
+// the next draw. Returns whether the row was paged out, so a pass over many
+// rows can page it out again with editorRowEvict.
+int editorRowPeek(editorRow *row){
+    if(row->chars)
+        return 0;
+    int fd = row->pageSpilled ? Paging.spillFd : Paging.sourceFd;
+    row->chars = editorCharsAlloc(row->size + 1);
+    if(pread(fd, row->chars, row->size, row->pageOffset) != row->size)
+        die("pread");
+    row->chars[row->size] = '\0';
+    editorUpdateRowRender(row);
+    if(!row->hlStale)
+        row->hlStale = 2;
+    Paging.faults++;
+    return 1;
+}
+
+// Makes the payload of row available until its block is paged out
+void editorRowLoad(editorRow *row){
+    editorPageTouch(row->index);
+    editorRowPeek(row);
+}
+
+// Frees the payload of row, spilling its chars first when the opened file
+// doesn't hold them. The size, comment state and brackets stay, so a paged
+// out row still counts in highlighting and the bracket index. Returns whether
+// the row is paged out.
+int editorRowEvict(editorRow *row){
+    if(row->chars == NULL)
+        return 1;
+    if(row->pageOffset == -1){
+        if(!editorPageSpillOpen() || pwrite(Paging.spillFd, row->chars, row->size, Paging.spillSize) != row->size)
+            return 0;
+        row->pageOffset = Paging.spillSize;
+        row->pageSpilled = 1;
+        Paging.spillSize += row->size;
+    }
+    editorCharsRelease(row->chars);
+    row->chars = NULL;
+    editorFree(MEM_RENDER, row->render);
+    row->render = NULL;
+    row->renderLength = 0;
+    editorFree(MEM_HIGHLIGHT, row->hlRuns);
+    row->hlRuns = NULL;
+    row->numHlRuns = 0;
+    editorFree(MEM_CHUNKS, row->chunks);
+    row->chunks = NULL;
+    row->numChunks = 0;
+    if(row->hlStale == 2)
+        row->hlStale = 0;
+    Paging.evictions++;
+    return 1;
+}
+
+int editorPageCompare(const void *a, const void *b){
+    long long useA = Paging.lastUse[*(const int *)a];
+    long long useB = Paging.lastUse[*(const int *)b];
+    return (useA > useB) - (useA < useB);
+}
+
+// Pages out the least recently used blocks until the payloads fit the budget.
+// The blocks of the cursor and of the screen are used now, so they stay, but
+// their other rows go as well if the budget still isn't met.
+void editorPageTrim(){
+    if(Paging.budget == 0 || editorPagedBytes() <= Paging.budget)
+        return;
+    long long pinned = Paging.tick + 1;
+    if(EditorConfig.cursorY < EditorConfig.numRows)
+        editorPageTouch(EditorConfig.cursorY);
+    int y = EditorConfig.rowOffset;
+    for(int lines = 0; lines < EditorConfig.screenRows && y < EditorConfig.numRows; lines++, y = editorNextVisibleRow(y))
+        editorPageTouch(y);
+    
+    qsort(Paging.loaded, Paging.numLoaded, sizeof(int), editorPageCompare);
+    int kept = 0;
+    for(int i = 0; i < Paging.numLoaded; i++){
+        int b = Paging.loaded[i];
+        int evicted = Paging.lastUse[b] < pinned && editorPagedBytes() > Paging.budget;
+        int last = (b + 1) * kPageBlockRows < EditorConfig.numRows ? (b + 1) * kPageBlockRows : EditorConfig.numRows;
+        for(int j = b * kPageBlockRows; evicted && j < last; j++)
+            evicted = editorRowEvict(&EditorConfig.rows[j]);
+        if(evicted)
+            Paging.lastUse[b] = 0;
+        else
+            Paging.loaded[kept++] = b;
+    }
+    Paging.numLoaded = kept;
+    
+    for(int i = 0; i < Paging.numLoaded && editorPagedBytes() > Paging.budget; i++){
+        int b = Paging.loaded[i];
+        int last = (b + 1) * kPageBlockRows < EditorConfig.numRows ? (b + 1) * kPageBlockRows : EditorConfig.numRows;
+        for(int j = b * kPageBlockRows; j < last; j++)
+            if(j != EditorConfig.cursorY && (j < EditorConfig.rowOffset || j >= y))
+                editorRowEvict(&EditorConfig.rows[j]);
+    }
+}
+
+// Whether any row is paged out to the opened file rather than the spill file
+int editorPageSourceRows(){
+    if(Paging.sourceFd == -1)
+        return 0;
+    for(int j = 0; j < EditorConfig.numRows; j++)
+        if(EditorConfig.rows[j].chars == NULL && !EditorConfig.rows[j].pageSpilled)
+            return 1;
+    return 0;
+}
+
+// Forgets the pages of a closed buffer
+void editorPageReset(){
+    if(Paging.sourceFd != -1)
+        close(Paging.sourceFd);
+    if(Paging.spillFd != -1)
+        close(Paging.spillFd);
+    Paging.sourceFd = -1;
+    Paging.sourceLost = 0;
+    Paging.spillFd = -1;
+    Paging.spillSize = 0;
+    for(int i = 0; i < Paging.numLoaded; i++)
+        Paging.lastUse[Paging.loaded[i]] = 0;
+    Paging.numLoaded = 0;
+}
+
+///// FILE I/O /////
+
+// Safe on any thread: the snapshot is immutable and the buffer is not tracked
+char *editorSnapshotToString(editorSnapshot *snapshot, int *bufferLength){
+    int totalLength = 0;
+    for(int b = 0; b < snapshot->numBlocks; b++)
+        for(int j = 0; j < snapshot->blocks[b]->numRows; j++)
+            totalLength += snapshot->blocks[b]->lines[j].size + 1;
+    *bufferLength = totalLength;
+    
+    char *buffer = malloc(totalLength);
+    char *p = buffer;
+    for(int b = 0; b < snapshot->numBlocks; b++){
+        for(int j = 0; j < snapshot->blocks[b]->numRows; j++){
+            editorSnapshotLine *line = &snapshot->blocks[b]->lines[j];
+            memcpy(p, line->chars, line->size);
+            p += line->size;
+            *p = '\n';
+            p++;
+        }
+    }
+    
+    return buffer;
+}
+
+void editorOpen(char *fileName){
+    free(EditorConfig.filename);
+    EditorConfig.filename = strdup(fileName);
+    
+    editorSelectSyntaxHighlight();
+    
+    FILE *fp = fopen(fileName, "r");
+    if(!fp)
+        die("fopen");
+    
+    struct stat st;
+    if(fstat(fileno(fp), &st) == -1)
+        die("fstat");
+    if(Paging.budget)
+        Paging.sourceFd = fcntl(fileno(fp), F_DUPFD_CLOEXEC, 0);
+    if(!editorCacheLoad(fileno(fp), &st)){
+        // Line starts are collected for the cache of large files
+        uint64_t *starts = NULL;
+        int startsCapacity = 0;
+        uint64_t offset = 0;
+        
+        char *line = NULL;
+        size_t lineCap = 0;
+        ssize_t lineLength;
+        while((lineLength = getline(&line, &lineCap, fp)) != -1){
+            if(st.st_size >= kCacheMinSize){
+                if(EditorConfig.numRows == startsCapacity){
+                    startsCapacity = startsCapacity ? startsCapacity * 2 : 1024;
+                    starts = realloc(starts, sizeof(uint64_t) * startsCapacity);
+                }
+                starts[EditorConfig.numRows] = offset;
+            }
+            off_t lineStart = offset;
+            offset += lineLength;
+            EditorConfig.fileTrailingNewline = line[lineLength - 1] == '\n';
+            while(lineLength > 0 && (line[lineLength - 1] == '\n' || line[lineLength - 1] == '\r'))
+                lineLength--;
+            editorInsertRow(EditorConfig.numRows, line, lineLength);
+            if(Paging.sourceFd != -1)
+                EditorConfig.rows[EditorConfig.numRows - 1].pageOffset = lineStart;
+            if(EditorConfig.numRows % kPageBlockRows == 0)
+                editorPageTrim();
+        }
+        free(line);
+        if(starts)
+            editorCacheStore(&st, starts);
+        free(starts);
+    }
+    fclose(fp);
+    editorPageTrim(); // The rows read since the last trim may still be over the budget
+    EditorConfig.dirtyFlag = 0;
+    
+    if(EditorConfig.headless)
+        editorRecordFileState();
+    else{
+        editorWatchFile();
+        editorJournalOpen();
+    }
+}
+
+// Empties the editor so another file can be opened. Refuses while there are
+// unsaved changes or a save is running; returns whether it closed the buffer.
+int editorCloseBuffer(){
+    if(EditorConfig.dirtyFlag){
+        editorSetStatusMessage("Unsaved changes! Save with Ctrl-S before opening another file");
+        return 0;
+    }
+    if(EditorConfig.saving){
+        editorSetStatusMessage("Save in progress, try again when it is done");
+        return 0;
+    }
+    
+    editorFollowStop();
+    editorJournalClose(0);
+    editorClearCursors();
+    editorWordsClear();
+    for(int j = 0; j < EditorConfig.numRows; j++)
+        editorFreeRow(&EditorConfig.rows[j]);
+    EditorConfig.numRows = 0;
+    editorPageReset();
+    EditorConfig.version++;
+    BracketTree.valid = 0;
+    editorFoldsClear();
+    free(EditorConfig.filename);
+    EditorConfig.filename = NULL;
+    EditorConfig.syntax = NULL;
+    EditorConfig.cursorX = 0;
+    EditorConfig.cursorY = 0;
+    EditorConfig.rowOffset = 0;
+    EditorConfig.colOffset = 0;
+    EditorConfig.searchMatchRow = -1;
+    EditorConfig.fileTrailingNewline = 1;
+    return 1;
+}
+
+// Replaces the buffer with fileName and puts the cursor on line, col
+int editorOpenAt(char *fileName, int line, int col){
+    if(access(fileName, R_OK) == -1){
+        editorSetStatusMessage("Can't open %s: %s", fileName, strerror(errno));
+        return 0;
+    }
+    if(!editorCloseBuffer())
+        return 0;
+    
+    editorOpen(fileName);
+    if(line >= EditorConfig.numRows)
+        line = EditorConfig.numRows ? EditorConfig.numRows - 1 : 0;
+    EditorConfig.cursorY = line;
+    EditorConfig.cursorX = 0;
+    if(line < EditorConfig.numRows && col <= EditorConfig.rows[line].size)
+        EditorConfig.cursorX = col;
+    EditorConfig.rowOffset = line > EditorConfig.screenRows / 2 ? line - EditorConfig.screenRows / 2 : 0;
+    return 1;
+}
+
+typedef struct editorSaveTask {
+    editorTask task;
+    char *filename;
+    editorSnapshot *snapshot;
+    off_t length;
+    int dirtyFlag; // Edits included in the snapshot
+    off_t journalOffset;
+    int paged; // Rows may be paged out, to be read from the files below
+    int sourceFd;
+    int spillFd;
+    int error;
+} editorSaveTask;
+
+// Writes out the save buffer
+int editorSaveFlush(int fd, char *buffer, size_t *used){
+    size_t written = 0;
+    while(written < *used){
+        ssize_t n = write(fd, &buffer[written], *used - written);
+        if(n == -1 && errno != EINTR)
+            return 0;
+        if(n > 0)
+            written += n;
+    }
+    *used = 0;
+    return 1;
+}
+
+// Adds a line and its newline to the save buffer, reading it back from disk
+// if it was paged out
+int editorSaveLine(editorSaveTask *save, int fd, editorSnapshotLine *line, char *buffer, size_t *used){
+    int done = 0;
+    while(done < line->size){
+        if(*used == kPageSaveBuffer && !editorSaveFlush(fd, buffer, used))
+            return 0;
+        size_t n = kPageSaveBuffer - *used;
+        if(n > (size_t)(line->size - done))
+            n = line->size - done;
+        if(line->chars)
+            memcpy(&buffer[*used], &line->chars[done], n);
+        else{
+            ssize_t got = pread(line->spilled ? save->spillFd : save->sourceFd, &buffer[*used], n, line->offset + done);
+            if(got != (ssize_t)n){
+                if(got >= 0)
+                    errno = EIO; // The file was cut short under us
+                return 0;
+            }
+        }
+        *used += n;
+        done += n;
+    }
+    if(*used == kPageSaveBuffer && !editorSaveFlush(fd, buffer, used))
+        return 0;
+    buffer[(*used)++] = '\n';
+    save->length += line->size + 1;
+    return 1;
+}
+
+// Streams the snapshot to a file beside the original and renames it over,
+// since rows still paged out are read from the original
+void editorSavePaged(editorSaveTask *save){
+    char tmp[1100];
+    snprintf(tmp, sizeof(tmp), "%s.kbsave-%d", save->filename, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd == -1){
+        save->error = errno;
+        return;
+    }
+    struct stat st;
+    if(stat(save->filename, &st) == 0)
+        fchmod(fd, st.st_mode & 07777);
+    
+    char *buffer = malloc(kPageSaveBuffer);
+    size_t used = 0;
+    int ok = 1;
+    editorSnapshot *snapshot = save->snapshot;
+    for(int b = 0; ok && b < snapshot->numBlocks; b++)
+        for(int j = 0; ok && j < snapshot->blocks[b]->numRows; j++)
+            ok = editorSaveLine(save, fd, &snapshot->blocks[b]->lines[j], buffer, &used);
+    ok = ok && editorSaveFlush(fd, buffer, &used);
+    free(buffer);
+    ok = ok && fsync(fd) == 0; // On disk before it replaces the original
+    ok = close(fd) == 0 && ok;
+    ok = ok && rename(tmp, save->filename) == 0;
+    if(!ok){
+        save->error = errno ? errno : EIO;
+        unlink(tmp);
+    }
+}
+
+// Runs on the worker thread
+void editorSaveRun(editorTask *task){
+    editorSaveTask *save = (editorSaveTask *)task;
+    if(save->paged){
+        editorSavePaged(save);
+        return;
+    }
+    int length;
+    char *buffer = editorSnapshotToString(save->snapshot, &length);
+    save->length = length;
+    int fd = open(save->filename, O_RDWR | O_CREAT, 0644); // 0644 = Permissions
+    
+    if(fd != -1){
+        if(ftruncate(fd, save->length) != -1){
+            if(write(fd, buffer, save->length) == save->length){
+                close(fd);
+                free(buffer);
+                return;
+            }
+        }
+        save->error = errno;
+        close(fd);
+        free(buffer);
+        return;
+    }
+    save->error = errno;
+    free(buffer);
+}
+
+void editorSaveDone(editorTask *task){
+    editorSaveTask *save = (editorSaveTask *)task;
+    EditorConfig.saving = 0;
+    if(save->error)
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(save->error));
+    else{
+        EditorConfig.dirtyFlag -= save->dirtyFlag;
+        EditorConfig.fileTrailingNewline = 1;
+        editorWatchFile();
+        editorJournalRebase(save->journalOffset);
+        editorSetStatusMessage("%lld bytes written to disk.", (long long)save->length);
+    }
+    free(save->filename);
+    editorSnapshotRelease(save->snapshot);
+    free(save);
+}
+
+void editorSave(){
+    if(EditorConfig.saving){
+        editorSetStatusMessage("Save already in progress");
+        return;
+    }
+    if(Paging.sourceLost){
+        editorSetStatusMessage("Can't save! Paged out lines were overwritten on disk, quit and reopen.");
+        return;
+    }
+    if(EditorConfig.filename == NULL){
+        EditorConfig.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+        if(EditorConfig.filename == NULL){
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+        editorSelectSyntaxHighlight();
+    }
+    
+    editorSaveTask *save = malloc(sizeof(editorSaveTask));
+    save->task.run = editorSaveRun;
+    save->task.done = editorSaveDone;
+    save->filename = strdup(EditorConfig.filename);
+    save->snapshot = editorSnapshotTake();
+    save->dirtyFlag = EditorConfig.dirtyFlag;
+    save->paged = Paging.budget != 0; // Rows may be spilled even without a file
+    save->sourceFd = Paging.sourceFd;
+    save->spillFd = Paging.spillFd;
+    save->length = 0;
+    save->error = 0;
+    
+    // Edits journaled after this point are not part of the saved buffer
+    editorJournalFlush();
+    save->journalOffset = (EditorConfig.journalFd != -1) ? lseek(EditorConfig.journalFd, 0, SEEK_CUR) + (off_t)EditorConfig.journalLength : 0;
+    
+    EditorConfig.saving = 1;
+    editorSubmitTask(&save->task);
+    editorSetStatusMessage("Saving...");
+}
+
+///// FILE WATCH /////
+
+void editorRecordFileState(){
+    struct stat st;
+    if(EditorConfig.filename && stat(EditorConfig.filename, &st) == 0){
+        EditorConfig.fileSize = st.st_size;
+        EditorConfig.fileMtime = st.st_mtim;
+        EditorConfig.fileInode = st.st_ino;
+    }
+}
+
+// Watches the file's directory so replacements by rename are seen as well
+void editorWatchFile(){
+    if(EditorConfig.watchFd == -1)
+        EditorConfig.watchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    editorRecordFileState(); // The journal header is checked against it, watched or not
+    if(EditorConfig.watchFd == -1)
+        return;
+    if(EditorConfig.watchWd != -1)
+        inotify_rm_watch(EditorConfig.watchFd, EditorConfig.watchWd);
+    
+    char dir[1024];
+    char *slash = strrchr(EditorConfig.filename, '/');
+    if(slash)
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - EditorConfig.filename + 1), EditorConfig.filename);
+    else
+        snprintf(dir, sizeof(dir), ".");
+    EditorConfig.watchWd = inotify_add_watch(EditorConfig.watchFd, dir, IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE);
+}
+
+// Last len bytes the buffer would occupy on disk, ending at the known file size
+int editorBufferTail(char *buf, int len){
+    int filled = 0;
+    if(EditorConfig.fileTrailingNewline && len > 0){
+        buf[len - 1] = '\n';
+        filled = 1;
+    }
+    for(int r = EditorConfig.numRows - 1; r >= 0 && filled < len; r--){
+        editorRow *row = &EditorConfig.rows[r];
+        editorRowLoad(row);
+        int n = (row->size < len - filled) ? row->size : len - filled;
+        memcpy(&buf[len - filled - n], &row->chars[row->size - n], n);
+        filled += n;
+        if(r > 0 && filled < len)
+            buf[len - ++filled] = '\n';
+    }
+    return filled;
+}
+
+// Splits data into rows inserted at pos; the first piece may continue row pos - 1
+int editorInsertLines(int pos, char *data, ssize_t length, int continueRow){
+    ssize_t start = 0;
+    while(start < length){
+        char *newline = memchr(&data[start], '\n', length - start);
+        ssize_t end = newline ? newline - data : length;
+        ssize_t lineLength = end - start;
+        while(lineLength > 0 && data[start + lineLength - 1] == '\r')
+            lineLength--;
+        if(continueRow)
+            editorRowAppendString(&EditorConfig.rows[pos - 1], &data[start], lineLength);
+        else
+            editorInsertRow(pos++, &data[start], lineLength);
+        continueRow = 0;
+        start = end + 1;
+    }
+    EditorConfig.fileTrailingNewline = (length > 0) ? data[length - 1] == '\n' : EditorConfig.fileTrailingNewline;
+    return pos;
+}
+
+// Appends the bytes past the known size if everything before it is unchanged.
+// The new bytes are read and split into rows a block at a time.
+int editorReloadAppended(int fd, off_t newSize){
+    char expected[4096];
+    char actual[4096];
+    off_t known = EditorConfig.fileSize;
+    int tail = (known < (off_t)sizeof(expected)) ? known : (int)sizeof(expected);
+    if(editorBufferTail(expected, tail) != tail)
+        return 0;
+    if(pread(fd, actual, tail, known - tail) != tail || memcmp(expected, actual, tail))
+        return 0;
+    
+    char *buffer = malloc(kFollowChunk);
+    off_t offset = known;
+    while(offset < newSize){
+        size_t want = (newSize - offset < (off_t)kFollowChunk) ? (size_t)(newSize - offset) : kFollowChunk;
+        ssize_t n = pread(fd, buffer, want, offset);
+        if(n <= 0)
+            break;
+        int continueRow = EditorConfig.numRows > 0 && !EditorConfig.fileTrailingNewline;
+        editorInsertLines(EditorConfig.numRows, buffer, n, continueRow);
+        offset += n;
+    }
+    free(buffer);
+    return 1;
+}
+
+// Old rows replaced by new lines, both counted from the first line compared
+typedef struct editorDiffHunk {
+    int oldStart;
+    int oldLength;
+    int newStart;
+    int newLength;
+} editorDiffHunk;
+
+// Row i and new line j hold the same text; hashes are counted from first
+int editorDiffEqual(int i, int j, int first, uint64_t *oldHashes, uint64_t *newHashes, const char *data, off_t *lineStarts, int *lineLengths){
+    editorRow *row = &EditorConfig.rows[i];
+    return oldHashes[i - first] == newHashes[j - first] && row->size == lineLengths[j] && !memcmp(row->chars, &data[lineStarts[j]], row->size);
+}
+
+// Diffs the old rows [first, oldEnd) against the new lines [first, newEnd).
+// Lines found once on each side anchor the match, as in a patience diff:
+// the longest run of anchors in the same order on both sides is kept, each
+// anchor is grown over the equal lines around it, and what is left between
+// them becomes the hunks. Returns the number of hunks left in *hunks.
+int editorDiffLines(int first, int oldEnd, int newEnd, const char *data, off_t *lineStarts, int *lineLengths, editorDiffHunk **hunks){
+    int n = oldEnd - first;
+    int m = newEnd - first;
+    uint64_t *oldHashes = malloc(sizeof(uint64_t) * (n + 1));
+    uint64_t *newHashes = malloc(sizeof(uint64_t) * (m + 1));
+    for(int i = first; i < oldEnd; i++)
+        oldHashes[i - first] = editorHash(0xcbf29ce484222325ULL, EditorConfig.rows[i].chars, EditorConfig.rows[i].size);
+    for(int j = first; j < newEnd; j++)
+        newHashes[j - first] = editorHash(0xcbf29ce484222325ULL, &data[lineStarts[j]], lineLengths[j]);
+    
+    // Open addressing on the hash; counts stop at 2 since only unique lines matter
+    int slots = 16;
+    while(slots < 2 * (n + m))
+        slots *= 2;
+    struct { uint64_t hash; int oldCount, newCount, oldLine; } *table = calloc(slots, sizeof(*table));
+    for(int side = 0; side < 2; side++){
+        for(int k = first; k < (side ? newEnd : oldEnd); k++){
+            uint64_t hash = side ? newHashes[k - first] : oldHashes[k - first];
+            int slot = hash & (slots - 1);
+            while((table[slot].oldCount || table[slot].newCount) && table[slot].hash != hash)
+                slot = (slot + 1) & (slots - 1);
+            table[slot].hash = hash;
+            if(side == 0){
+                table[slot].oldLine = k;
+                table[slot].oldCount += table[slot].oldCount < 2;
+            }
+            else
+                table[slot].newCount += table[slot].newCount < 2;
+        }
+    }
+    
+    // Anchors come out in new line order; patience sorting finds the longest
+    // run whose old lines increase too
+    int *anchorOld = malloc(sizeof(int) * (m + 1));
+    int *anchorNew = malloc(sizeof(int) * (m + 1));
+    int *previous = malloc(sizeof(int) * (m + 1));
+    int *piles = malloc(sizeof(int) * (m + 1));
+    int numAnchors = 0;
+    int numPiles = 0;
+    for(int j = first; j < newEnd; j++){
+        int slot = newHashes[j - first] & (slots - 1);
+        while(table[slot].hash != newHashes[j - first])
+            slot = (slot + 1) & (slots - 1);
+        if(table[slot].oldCount != 1 || table[slot].newCount != 1)
+            continue;
+        int i = table[slot].oldLine;
+        if(!editorDiffEqual(i, j, first, oldHashes, newHashes, data, lineStarts, lineLengths))
+            continue;
+        int lo = 0, hi = numPiles;
+        while(lo < hi){
+            int mid = (lo + hi) / 2;
+            if(anchorOld[piles[mid]] < i)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        anchorOld[numAnchors] = i;
+        anchorNew[numAnchors] = j;
+        previous[numAnchors] = lo > 0 ? piles[lo - 1] : -1;
+        piles[lo] = numAnchors++;
+        if(lo == numPiles)
+            numPiles++;
+    }
+    // Walks the longest run back, leaving it in order at the start of piles
+    for(int a = numPiles ? piles[numPiles - 1] : -1, k = numPiles - 1; a != -1; a = previous[a], k--)
+        piles[k] = a;
+    
+    int numHunks = 0;
+    *hunks = malloc(sizeof(editorDiffHunk) * (numPiles + 1));
+    int oldNext = first;
+    int newNext = first;
+    for(int k = 0; k <= numPiles; k++){
+        int i = oldEnd, j = newEnd, length = 0;
+        if(k < numPiles){
+            i = anchorOld[piles[k]];
+            j = anchorNew[piles[k]];
+            if(i < oldNext || j < newNext)
+                continue; // Already inside the run grown from an earlier anchor
+            while(i > oldNext && j > newNext && editorDiffEqual(i - 1, j - 1, first, oldHashes, newHashes, data, lineStarts, lineLengths)){
+                i--;
+                j--;
+                length++;
+            }
+            length++;
+            while(i + length < oldEnd && j + length < newEnd && editorDiffEqual(i + length, j + length, first, oldHashes, newHashes, data, lineStarts, lineLengths))
+                length++;
+        }
+        if(i > oldNext || j > newNext){
+            (*hunks)[numHunks].oldStart = oldNext;
+            (*hunks)[numHunks].oldLength = i - oldNext;
+            (*hunks)[numHunks].newStart = newNext;
+            (*hunks)[numHunks].newLength = j - newNext;
+            numHunks++;
+        }
+        oldNext = i + length;
+        newNext = j + length;
+    }
+    
+    free(oldHashes);
+    free(newHashes);
+    free(table);
+    free(anchorOld);
+    free(anchorNew);
+    free(previous);
+    free(piles);
+    return numHunks;
+}
+
+// Replaces the old rows of each hunk with its new lines in one pass over the
+// row array: each run of kept rows moves at most once, runs moving up in
+// order and runs moving down in reverse, so none is overwritten before it
+// moves. Then highlights from each hunk on.
+void editorApplyHunks(editorDiffHunk *hunks, int numHunks, int numLines, const char *data, off_t *lineStarts, int *lineLengths){
+    // Folds shift as if the rows were deleted and inserted one by one, last hunk first
+    for(int h = numHunks - 1; h >= 0; h--){
+        for(int r = 0; r < hunks[h].oldLength; r++)
+            editorFoldsShift(hunks[h].oldStart, -1);
+        for(int r = 0; r < hunks[h].newLength; r++)
+            editorFoldsShift(hunks[h].oldStart, 1);
+    }
+    // The bracket tree is rebuilt once the new rows are highlighted
+    int treeValid = BracketTree.valid;
+    BracketTree.valid = 0;
+    
+    if(numLines > EditorConfig.rowsCapacity){
+        EditorConfig.rowsCapacity = numLines;
+        EditorConfig.rows = editorRealloc(MEM_ROWS, EditorConfig.rows, sizeof(editorRow) * EditorConfig.rowsCapacity);
+    }
+    for(int h = 0; h < numHunks; h++)
+        for(int r = 0; r < hunks[h].oldLength; r++)
+            editorFreeRow(&EditorConfig.rows[hunks[h].oldStart + r]);
+    
+    // The kept rows after each hunk move by the lines it and the hunks before it added
+    for(int pass = 0; pass < 2; pass++){
+        for(int k = 0; k < numHunks; k++){
+            int h = pass ? numHunks - 1 - k : k;
+            int from = hunks[h].oldStart + hunks[h].oldLength;
+            int to = (h + 1 < numHunks) ? hunks[h + 1].oldStart : EditorConfig.numRows;
+            int delta = hunks[h].newStart + hunks[h].newLength - from;
+            if((pass == 0 && delta < 0) || (pass == 1 && delta > 0)){
+                memmove(&EditorConfig.rows[from + delta], &EditorConfig.rows[from], sizeof(editorRow) * (to - from));
+                for(int j = from + delta; j < to + delta; j++)
+                    EditorConfig.rows[j].index = j;
+            }
+        }
+    }
+    for(int h = 0; h < numHunks; h++){
+        for(int r = 0; r < hunks[h].newLength; r++){
+            int y = hunks[h].newStart + r;
+            editorRow *row = &EditorConfig.rows[y];
+            editorInitRow(row, y, &data[lineStarts[y]], lineLengths[y]);
+            editorWordsUpdate(row);
+            editorUpdateRowRender(row);
+        }
+    }
+    EditorConfig.numRows = numLines;
+    
+    // Each hunk is highlighted with the row after it, whose entry state may
+    // have changed; the range carries on while the comment state does
+    for(int h = 0; h < numHunks; h++)
+        if(hunks[h].newStart < numLines)
+            editorUpdateSyntaxRange(&EditorConfig.rows[hunks[h].newStart], hunks[h].newStart + hunks[h].newLength);
+    if(treeValid)
+        editorBracketTreeBuild();
+    EditorConfig.version++;
+}
+
+// Replaces only the rows that differ from the new contents of the file.
+// Only used without a memory budget, so every row is in memory. Returns 0
+// when the file can't be mapped or has a line longer than a row can hold.
+int editorReloadDiff(int fd, off_t newSize){
+    char *data = NULL;
+    if(newSize > 0){
+        data = mmap(NULL, newSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data == MAP_FAILED)
+            return 0;
+    }
+    
+    int numLines = 0;
+    int linesCap = 0;
+    off_t *lineStarts = NULL;
+    int *lineLengths = NULL;
+    off_t start = 0;
+    int ok = 1;
+    while(start < newSize){
+        char *newline = memchr(&data[start], '\n', newSize - start);
+        off_t end = newline ? newline - data : newSize;
+        off_t lineLength = end - start;
+        while(lineLength > 0 && data[start + lineLength - 1] == '\r')
+            lineLength--;
+        if(lineLength > INT_MAX){
+            ok = 0;
+            break;
+        }
+        if(numLines == linesCap){
+            linesCap = linesCap ? linesCap * 2 : 1024;
+            lineStarts = realloc(lineStarts, sizeof(off_t) * linesCap);
+            lineLengths = realloc(lineLengths, sizeof(int) * linesCap);
+        }
+        lineStarts[numLines] = start;
+        lineLengths[numLines++] = lineLength;
+        start = end + 1;
+    }
+    
+    if(ok){
+        int head = 0;
+        while(head < numLines && head < EditorConfig.numRows &&
+              EditorConfig.rows[head].size == lineLengths[head] &&
+              !memcmp(EditorConfig.rows[head].chars, &data[lineStarts[head]], lineLengths[head]))
+            head++;
+        int tail = 0;
+        while(tail < numLines - head && tail < EditorConfig.numRows - head){
+            editorRow *row = &EditorConfig.rows[EditorConfig.numRows - 1 - tail];
+            int line = numLines - 1 - tail;
+            if(row->size != lineLengths[line] || memcmp(row->chars, &data[lineStarts[line]], lineLengths[line]))
+                break;
+            tail++;
+        }
+        
+        editorDiffHunk *hunks;
+        int numHunks = editorDiffLines(head, EditorConfig.numRows - tail, numLines - tail, data, lineStarts, lineLengths, &hunks);
+        editorApplyHunks(hunks, numHunks, numLines, data, lineStarts, lineLengths);
+        free(hunks);
+        EditorConfig.fileTrailingNewline = newSize > 0 && data[newSize - 1] == '\n';
+    }
+    
+    free(lineStarts);
+    free(lineLengths);
+    if(data)
+        munmap(data, newSize);
+    return ok;
+}
+
+// Paged out rows may point into the old contents, so the file is read anew
+// instead of being compared with the buffer
+void editorReloadPaged(){
+    char *fileName = strdup(EditorConfig.filename);
+    int cursorX = EditorConfig.cursorX;
+    int cursorY = EditorConfig.cursorY;
+    int rowOffset = EditorConfig.rowOffset;
+    editorCloseBuffer();
+    editorOpen(fileName);
+    free(fileName);
+    EditorConfig.cursorX = cursorX;
+    EditorConfig.cursorY = cursorY;
+    EditorConfig.rowOffset = rowOffset < EditorConfig.numRows ? rowOffset : 0;
+}
+
+void editorReloadFile(){
+    struct stat st;
+    if(stat(EditorConfig.filename, &st) == -1)
+        return;
+    if(st.st_size == EditorConfig.fileSize && st.st_ino == EditorConfig.fileInode &&
+       st.st_mtim.tv_sec == EditorConfig.fileMtime.tv_sec && st.st_mtim.tv_nsec == EditorConfig.fileMtime.tv_nsec)
+        return;
+    
+    // Our own save in progress; its completion records the new state
+    if(EditorConfig.saving)
+        return;
+    
+    if(EditorConfig.dirtyFlag){
+        int inPlace = st.st_ino == EditorConfig.fileInode;
+        EditorConfig.fileSize = st.st_size;
+        EditorConfig.fileMtime = st.st_mtim;
+        EditorConfig.fileInode = st.st_ino;
+        if(inPlace && editorPageSourceRows()){
+            Paging.sourceLost = 1;
+            editorSetStatusMessage("File rewritten on disk under paged out lines! Saving disabled, quit and reopen.");
+            return;
+        }
+        editorSetStatusMessage("File changed on disk! Unsaved changes kept, save to overwrite.");
+        return;
+    }
+    
+    int fd = open(EditorConfig.filename, O_RDONLY);
+    if(fd == -1)
+        return;
+    
+    EditorConfig.journalPaused = 1;
+    int appended = st.st_ino == EditorConfig.fileInode && st.st_size > EditorConfig.fileSize &&
+                   editorReloadAppended(fd, st.st_size);
+    int reloaded = 1;
+    if(!appended && Paging.budget)
+        editorReloadPaged();
+    else if(!appended)
+        reloaded = editorReloadDiff(fd, st.st_size);
+    EditorConfig.journalPaused = 0;
+    close(fd);
+    
+    if(!reloaded){
+        // The buffer no longer matches the file, so it counts as changed
+        EditorConfig.fileSize = st.st_size;
+        EditorConfig.fileMtime = st.st_mtim;
+        EditorConfig.fileInode = st.st_ino;
+        EditorConfig.dirtyFlag = 1;
+        editorSetStatusMessage("File changed on disk but can't be reloaded! Save to overwrite.");
+        return;
+    }
+    EditorConfig.fileSize = st.st_size;
+    EditorConfig.fileMtime = st.st_mtim;
+    EditorConfig.fileInode = st.st_ino;
+    EditorConfig.dirtyFlag = 0;
+    editorJournalReset();
+    if(EditorConfig.cursorY > EditorConfig.numRows)
+        EditorConfig.cursorY = EditorConfig.numRows;
+    editorMoveCursor(-1);
+    editorSetStatusMessage(appended ? "File grew on disk, new lines appended" : "File changed on disk, reloaded");
+}
+
+// Drains pending inotify events, reloading when they concern the open file
+int editorCheckFileChanges(){
+    if(EditorConfig.watchFd == -1 || EditorConfig.filename == NULL)
+        return 0;
+    
+    char *name = strrchr(EditorConfig.filename, '/');
+    name = name ? name + 1 : EditorConfig.filename;
+    
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    ssize_t len;
+    while((len = read(EditorConfig.watchFd, buf, sizeof(buf))) > 0){
+        for(char *p = buf; p < buf + len; ){
+            struct inotify_event *event = (struct inotify_event *)p;
+            if(event->len && !strcmp(event->name, name))
+                changed = 1;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    if(changed && EditorConfig.followFd != -1)
+        editorFollowRead();
+    else if(changed)
+        editorReloadFile();
+    return changed;
+}
+
+///// FOLLOW /////
+
+// Appends whatever was written to the followed file since the last read.
+// Bytes are read in large blocks and split into rows in one pass, so only
+// the new rows are rendered and highlighted.
+void editorFollowRead(){
+    if(EditorConfig.followFd == -1)
+        return;
+    
+    struct stat st;
+    if(stat(EditorConfig.filename, &st) == 0 && st.st_ino != EditorConfig.followInode){
+        // Rotated: finish the old file, then carry on with the new one
+        editorFollowIngest();
+        close(EditorConfig.followFd);
+        EditorConfig.followFd = open(EditorConfig.filename, O_RDONLY | O_CLOEXEC);
+        EditorConfig.followInode = st.st_ino;
+        EditorConfig.followOffset = 0;
+        editorSetStatusMessage("File replaced, following the new one");
+        if(EditorConfig.followFd == -1){
+            editorSetStatusMessage("Can't follow: %s", strerror(errno));
+            return;
+        }
+    }
+    else if(fstat(EditorConfig.followFd, &st) == 0 && st.st_size < EditorConfig.followOffset){
+        // The old rows are gone from the file, so they go from the buffer too
+        EditorConfig.journalPaused = 1;
+        while(EditorConfig.numRows > 0)
+            editorDelRow(EditorConfig.numRows - 1);
+        EditorConfig.journalPaused = 0;
+        EditorConfig.dirtyFlag = 0;
+        EditorConfig.cursorX = 0;
+        EditorConfig.cursorY = 0;
+        EditorConfig.rowOffset = 0;
+        EditorConfig.followOffset = 0;
+        editorSetStatusMessage("File truncated, following from its start");
+    }
+    editorFollowIngest();
+}
+
+void editorFollowIngest(){
+    int atEnd = EditorConfig.cursorY >= EditorConfig.numRows - 1;
+    char *buffer = malloc(kFollowChunk);
+    size_t total = 0;
+    ssize_t n;
+    EditorConfig.journalPaused = 1;
+    while(total < kFollowMaxRead && (n = pread(EditorConfig.followFd, buffer, kFollowChunk, EditorConfig.followOffset)) > 0){
+        int continueRow = EditorConfig.numRows > 0 && !EditorConfig.fileTrailingNewline;
+        editorInsertLines(EditorConfig.numRows, buffer, n, continueRow);
+        EditorConfig.followOffset += n;
+        total += n;
+    }
+    EditorConfig.journalPaused = 0;
+    EditorConfig.dirtyFlag = 0;
+    free(buffer);
+    
+    // A writer faster than us gets read again after the next frame
+    if(total >= kFollowMaxRead)
+        editorTimerSchedule(&EditorConfig.followTimer, 0);
+    
+    // The journal header has to match the file the buffer now mirrors
+    off_t oldSize = EditorConfig.fileSize;
+    struct timespec oldMtime = EditorConfig.fileMtime;
+    ino_t oldInode = EditorConfig.fileInode;
+    editorRecordFileState();
+    if(EditorConfig.fileSize != oldSize || EditorConfig.fileInode != oldInode ||
+       EditorConfig.fileMtime.tv_sec != oldMtime.tv_sec || EditorConfig.fileMtime.tv_nsec != oldMtime.tv_nsec)
+        editorJournalReset();
+    if(total && atEnd){
+        EditorConfig.cursorY = EditorConfig.numRows > 0 ? EditorConfig.numRows - 1 : 0;
+        EditorConfig.cursorX = 0;
+    }
+}
+
+void editorFollowStop(){
+    if(EditorConfig.followFd == -1)
+        return;
+    close(EditorConfig.followFd);
+    EditorConfig.followFd = -1;
+    editorTimerCancel(&EditorConfig.followTimer);
+}
+
+void editorFollowStart(){
+    if(EditorConfig.filename == NULL){
+        editorSetStatusMessage("No file to follow");
+        return;
+    }
+    if(EditorConfig.dirtyFlag){
+        editorSetStatusMessage("Save your changes before following the file");
+        return;
+    }
+    EditorConfig.followFd = open(EditorConfig.filename, O_RDONLY | O_CLOEXEC);
+    if(EditorConfig.followFd == -1){
+        editorSetStatusMessage("Can't follow: %s", strerror(errno));
+        return;
+    }
+    struct stat st;
+    fstat(EditorConfig.followFd, &st);
+    EditorConfig.followInode = st.st_ino;
+    EditorConfig.followOffset = EditorConfig.fileSize;
+    if(EditorConfig.watchFd == -1)
+        editorWatchFile();
+    
+    EditorConfig.cursorY = EditorConfig.numRows > 0 ? EditorConfig.numRows - 1 : 0;
+    EditorConfig.cursorX = 0;
+    editorFollowRead();
+    editorSetStatusMessage("Following %s (read-only, Ctrl-W to stop)", EditorConfig.filename);
+}
+
+void editorToggleFollow(){
+    if(EditorConfig.followFd == -1)
+        editorFollowStart();
+    else{
+        editorFollowStop();
+        editorSetStatusMessage("Stopped following");
+    }
+}
+
+void editorFollowTimer(){
+    editorFollowRead();
+    EditorEvents.redraw = 1;
+}
+
+///// JOURNAL /////
+
+// Edits since the last save are appended here so a crash can be replayed on open
+void editorJournalPath(char *buf, size_t size, const char *fileName){
+    const char *slash = strrchr(fileName, '/');
+    if(slash)
+        snprintf(buf, size, "%.*s.%s.kbswp", (int)(slash - fileName + 1), fileName, slash + 1);
+    else
+        snprintf(buf, size, ".%s.kbswp", fileName);
+}
+
+void editorJournalPutVarint(unsigned long long value){
+    if(EditorConfig.journalLength + 10 > EditorConfig.journalCapacity){
+        EditorConfig.journalCapacity = EditorConfig.journalCapacity ? EditorConfig.journalCapacity * 2 : 4096;
+        EditorConfig.journalBuffer = editorRealloc(MEM_JOURNAL, EditorConfig.journalBuffer, EditorConfig.journalCapacity);
+    }
+    do{
+        unsigned char byte = value & 0x7F;
+        value >>= 7;
+        EditorConfig.journalBuffer[EditorConfig.journalLength++] = byte | (value ? 0x80 : 0);
+    } while(value);
+}
+
+void editorJournalPutRaw(const char *s, size_t len){
+    if(EditorConfig.journalLength + len > EditorConfig.journalCapacity){
+        EditorConfig.journalCapacity = (EditorConfig.journalLength + len) * 2;
+        EditorConfig.journalBuffer = editorRealloc(MEM_JOURNAL, EditorConfig.journalBuffer, EditorConfig.journalCapacity);
+    }
+    memcpy(&EditorConfig.journalBuffer[EditorConfig.journalLength], s, len);
+    EditorConfig.journalLength += len;
+}
+
+void editorJournalPutBytes(const char *s, size_t len){
+    editorJournalPutVarint(len);
+    editorJournalPutRaw(s, len);
+}
+
+void editorJournalFlush(){
+    if(EditorConfig.journalFd == -1 || (EditorConfig.journalLength == 0 && !EditorConfig.journalFailed))
+        return;
+    size_t written = 0;
+    ssize_t n = 0;
+    while(written < EditorConfig.journalLength){
+        n = write(EditorConfig.journalFd, &EditorConfig.journalBuffer[written], EditorConfig.journalLength - written);
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        written += n;
+    }
+    // Whatever didn't reach the file stays buffered and is retried later
+    EditorConfig.journalLength -= written;
+    memmove(EditorConfig.journalBuffer, &EditorConfig.journalBuffer[written], EditorConfig.journalLength);
+    if(EditorConfig.journalLength > 0 || fdatasync(EditorConfig.journalFd) == -1){
+        if(!EditorConfig.journalFailed){
+            editorSetStatusMessage("Can't write journal: %s", n == 0 ? "no space written" : strerror(errno));
+            EditorEvents.redraw = 1;
+        }
+        EditorConfig.journalFailed = 1;
+        editorTimerSchedule(&EditorConfig.journalTimer, kJournalFlushMs);
+        return;
+    }
+    if(EditorConfig.journalFailed){
+        editorSetStatusMessage("Journal written again");
+        EditorEvents.redraw = 1;
+    }
+    EditorConfig.journalFailed = 0;
+    editorTimerCancel(&EditorConfig.journalTimer);
+}
+
+// Records are an op byte followed by varints, so a typed char costs a few bytes.
+// A typed char is its column and then the byte itself.
+void editorJournalRecord(int op, int a, int b, const char *s, size_t len){
+    if(EditorConfig.journalFd == -1 || EditorConfig.journalPaused)
+        return;
+    editorJournalPutVarint(op);
+    editorJournalPutVarint(a);
+    if(op != JOURNAL_DELETE_ROW)
+        editorJournalPutVarint(b);
+    if(op == JOURNAL_INSERT_CHAR)
+        editorJournalPutVarint((unsigned char)s[0]);
+    if(op == JOURNAL_INSERT_ROW || op == JOURNAL_APPEND || op == JOURNAL_SET_ROW)
+        editorJournalPutBytes(s, len);
+    if(EditorConfig.journalLength >= kJournalFlushBytes)
+        editorJournalFlush();
+    else if(!EditorConfig.journalTimer.pending)
+        editorTimerSchedule(&EditorConfig.journalTimer, kJournalFlushMs);
+}
+
+// Starts an empty journal tied to the current state of the file on disk
+void editorJournalReset(){
+    if(EditorConfig.filename == NULL)
+        return;
+    if(EditorConfig.journalFd == -1){
+        char path[1024];
+        editorJournalPath(path, sizeof(path), EditorConfig.filename);
+        EditorConfig.journalFd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if(EditorConfig.journalFd == -1)
+            return;
+    }
+    if(ftruncate(EditorConfig.journalFd, 0) == -1 || lseek(EditorConfig.journalFd, 0, SEEK_SET) == -1)
+        return;
+    
+    EditorConfig.journalLength = 0;
+    if(EditorConfig.journalCapacity < 4){
+        EditorConfig.journalCapacity = 4096;
+        EditorConfig.journalBuffer = editorRealloc(MEM_JOURNAL, EditorConfig.journalBuffer, EditorConfig.journalCapacity);
+    }
+    memcpy(EditorConfig.journalBuffer, "KBJ2", 4);
+    EditorConfig.journalLength = 4;
+    editorJournalPutVarint(EditorConfig.fileSize);
+    editorJournalPutVarint(EditorConfig.fileMtime.tv_sec);
+    editorJournalPutVarint(EditorConfig.fileMtime.tv_nsec);
+    editorJournalFlush();
+}
+
+// Restarts the journal against the file just saved, keeping the records
+// after offset, which hold the edits made while saving. offset counts
+// records still buffered after a failed flush as if they were written.
+void editorJournalRebase(off_t offset){
+    editorJournalFlush();
+    char *tail = NULL;
+    size_t tailLength = 0;
+    if(EditorConfig.journalFd != -1){
+        off_t end = lseek(EditorConfig.journalFd, 0, SEEK_CUR);
+        off_t total = end + EditorConfig.journalLength;
+        if(end >= 0 && total > offset){
+            tail = malloc(total - offset);
+            if(end > offset){
+                ssize_t n = pread(EditorConfig.journalFd, tail, end - offset, offset);
+                tailLength = n > 0 ? n : 0;
+            }
+            size_t skip = offset > end ? offset - end : 0;
+            memcpy(&tail[tailLength], &EditorConfig.journalBuffer[skip], EditorConfig.journalLength - skip);
+            tailLength += EditorConfig.journalLength - skip;
+        }
+    }
+    
+    editorJournalReset();
+    if(tailLength > 0 && EditorConfig.journalFd != -1){
+        editorJournalPutRaw(tail, tailLength);
+        editorJournalFlush();
+    }
+    free(tail);
+}
+
+void editorJournalClose(int keep){
+    if(EditorConfig.journalFd == -1)
+        return;
+    editorJournalFlush();
+    close(EditorConfig.journalFd);
+    EditorConfig.journalFd = -1;
+    if(!keep){
+        char path[1024];
+        editorJournalPath(path, sizeof(path), EditorConfig.filename);
+        unlink(path);
+    }
+}
+
+int editorJournalGetVarint(const unsigned char *data, size_t length, size_t *pos, unsigned long long *value){
+    *value = 0;
+    for(int shift = 0; *pos < length && shift < 64; shift += 7){
+        unsigned char byte = data[(*pos)++];
+        *value |= (unsigned long long)(byte & 0x7F) << shift;
+        if(!(byte & 0x80))
+            return 1;
+    }
+    return 0;
+}
+
+// Applies a journal left by a previous session. Returns the number of edits
+// replayed, and in validLength the size of the journal up to the last good record.
+// damaged is set when a complete record didn't fit the buffer.
+int editorJournalReplay(size_t *validLength, int *damaged){
+    *validLength = 0;
+    *damaged = 0;
+    char path[1024];
+    editorJournalPath(path, sizeof(path), EditorConfig.filename);
+    int fd = open(path, O_RDONLY);
+    if(fd == -1)
+        return 0;
+    struct stat st;
+    if(fstat(fd, &st) == -1 || st.st_size < 4){
+        close(fd);
+        return 0;
+    }
+    unsigned char *data = malloc(st.st_size);
+    ssize_t got = read(fd, data, st.st_size);
+    size_t length = got > 0 ? got : 0;
+    close(fd);
+    
+    size_t pos = 4;
+    unsigned long long size, sec, nsec;
+    if(length < 4 ||
+       !editorJournalGetVarint(data, length, &pos, &size) ||
+       !editorJournalGetVarint(data, length, &pos, &sec) ||
+       !editorJournalGetVarint(data, length, &pos, &nsec)){
+        free(data);
+        return 0;
+    }
+    if(memcmp(data, "KBJ2", 4) ||
+       (off_t)size != EditorConfig.fileSize || (time_t)sec != EditorConfig.fileMtime.tv_sec || (long)nsec != EditorConfig.fileMtime.tv_nsec){
+        // Recorded against a different version of the file, or in an older
+        // format; keep it aside
+        char stale[1040];
+        snprintf(stale, sizeof(stale), "%s.stale", path);
+        rename(path, stale);
+        free(data);
+        return -1;
+    }
+    
+    *validLength = pos;
+    int replayed = 0;
+    EditorConfig.journalPaused = 1;
+    while(pos < length){
+        unsigned long long op, a, b = 0, c = 0, len = 0;
+        if(!editorJournalGetVarint(data, length, &pos, &op) || !editorJournalGetVarint(data, length, &pos, &a))
+            break;
+        if(op != JOURNAL_DELETE_ROW && !editorJournalGetVarint(data, length, &pos, &b))
+            break;
+        if(op == JOURNAL_INSERT_CHAR && !editorJournalGetVarint(data, length, &pos, &c))
+            break;
+        if(op == JOURNAL_INSERT_ROW || op == JOURNAL_APPEND || op == JOURNAL_SET_ROW){
+            if(!editorJournalGetVarint(data, length, &pos, &len) || len > length - pos)
+                break;
+        }
+        // A torn record at the end ends the replay; one that doesn't fit the
+        // buffer means the journal is damaged
+        int rowOp = op == JOURNAL_INSERT_CHAR || op == JOURNAL_DELETE_CHAR || op == JOURNAL_APPEND || op == JOURNAL_TRUNCATE || op == JOURNAL_SET_ROW;
+        unsigned long long numRows = EditorConfig.numRows;
+        unsigned long long size = (rowOp && a < numRows) ? (unsigned long long)EditorConfig.rows[a].size : 0;
+        int valid = (op == JOURNAL_INSERT_ROW) ? a <= numRows :
+                    (op == JOURNAL_DELETE_ROW) ? a < numRows :
+                    !rowOp ? 0 :
+                    a >= numRows ? 0 :
+                    (op == JOURNAL_INSERT_CHAR) ? b <= size && c <= 0xFF :
+                    (op == JOURNAL_DELETE_CHAR || op == JOURNAL_TRUNCATE) ? b < size : 1;
+        if(!valid){
+            *damaged = 1;
+            break;
+        }
+        
+        editorRow *row = rowOp ? &EditorConfig.rows[a] : NULL;
+        if(op == JOURNAL_INSERT_ROW)
+            editorInsertRow(a, (char *)&data[pos], len);
+        else if(op == JOURNAL_DELETE_ROW)
+            editorDelRow(a);
+        else if(op == JOURNAL_INSERT_CHAR)
+            editorRowInsertChar(row, b, c);
+        else if(op == JOURNAL_DELETE_CHAR)
+            editorRowDelChar(row, b);
+        else if(op == JOURNAL_APPEND)
+            editorRowAppendString(row, (char *)&data[pos], len);
+        else if(op == JOURNAL_TRUNCATE)
+            editorRowTruncate(row, b);
+        else{
+            char *chars = editorCharsAlloc(len + 1);
+            memcpy(chars, &data[pos], len);
+            editorRowSetChars(row, chars, len);
+            editorUpdateSyntax(row);
+        }
+        pos += len;
+        replayed++;
+        *validLength = pos;
+    }
+    EditorConfig.journalPaused = 0;
+    free(data);
+    return replayed;
+}
+
+// Replays a leftover journal and keeps appending to it, or starts a new one
+void editorJournalOpen(){
+    size_t validLength;
+    int damaged;
+    int replayed = editorJournalReplay(&validLength, &damaged);
+    if(replayed <= 0){
+        editorJournalReset();
+        if(replayed < 0)
+            editorSetStatusMessage("Journal is from another version of the file, kept as .stale");
+        else if(damaged)
+            editorSetStatusMessage("Journal is damaged, no edits recovered");
+        return;
+    }
+    
+    char path[1024];
+    editorJournalPath(path, sizeof(path), EditorConfig.filename);
+    EditorConfig.journalFd = open(path, O_RDWR | O_CLOEXEC);
+    if(EditorConfig.journalFd != -1){
+        if(ftruncate(EditorConfig.journalFd, validLength) == -1 || lseek(EditorConfig.journalFd, 0, SEEK_END) == -1){
+            close(EditorConfig.journalFd);
+            EditorConfig.journalFd = -1;
+        }
+    }
+    if(damaged)
+        editorSetStatusMessage("Journal is damaged, recovered only the first %d edits from %s", replayed, path);
+    else
+        editorSetStatusMessage("Recovered %d unsaved edits from %s", replayed, path);
 }
 
-void editorFreeRow(editorRow *row){
-    free(row->render);
-    free(row->chars);
-    free(row->highlighting);
+///// FIND /////
+
+// Returns the offset of the first match of query in row at or after from, or -1
+int editorRowFind(editorRow *row, const char *query, int queryLength, int from){
+    if(from > row->size)
+        return -1;
+    char *match = memmem(&row->chars[from], row->size - from, query, queryLength);
+    return match ? match - row->chars : -1;
 }
 
-void editorDelRow(int pos){
-    if(pos < 0 || pos >= EditorConfig.numRows)
+void editorFindCallback(char *query, int key){
+    static int lastMatch = -1;
+    static int direction = 1;
+    
+    EditorConfig.searchMatchRow = -1;
+    
+    if(key == '\r' || key == '\x1b'){
+        lastMatch = -1;
+        direction = 1;
         return;
-    editorFreeRow(&EditorConfig.rows[pos]);
-    memmove(&EditorConfig.rows[pos], &EditorConfig.rows[pos + 1], sizeof(editorRow) * (EditorConfig.numRows - pos - 1));
-    for(int j = pos; j < EditorConfig.numRows - 1; j++)
-        EditorConfig.rows[j].index--;
-    EditorConfig.numRows--;
-    EditorConfig.dirtyFlag++;
+    }
+    else if(key == ARROW_RIGHT || key == ARROW_DOWN)
+        direction = 1;
+    else if(key == ARROW_LEFT || key == ARROW_UP)
+        direction = -1;
+    else{
+        lastMatch = -1;
+        direction = 1;
+    }
+    
+    if(lastMatch == -1)
+        direction = 1;
+    int current = lastMatch;
+    for(int i = 0; i < EditorConfig.numRows; i++){
+        current += direction;
+        if(current == -1)
+            current = EditorConfig.numRows - 1;
+        else if(current == EditorConfig.numRows)
+            current = 0;
+        
+        editorRow *row = &EditorConfig.rows[current];
+        int paged = editorRowPeek(row);
+        int match = editorRowFind(row, query, strlen(query), 0);
+        if(match != -1){
+            lastMatch = current;
+            EditorConfig.cursorY = current;
+            EditorConfig.cursorX = match;
+            EditorConfig.rowOffset = EditorConfig.numRows;
+            
+            EditorConfig.searchMatchRow = current;
+            EditorConfig.searchMatchX = EditorConfig.cursorX;
+            EditorConfig.searchMatchLength = strlen(query);
+            break;
+        }
+        if(paged)
+            editorRowEvict(row);
+    }
 }
 
-void editorRowAppendString(editorRow *row, char *s, size_t len){
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    EditorConfig.dirtyFlag++;
+void editorFind(){
+    int oldCursorX = EditorConfig.cursorX;
+    int oldCursorY = EditorConfig.cursorY;
+    int oldColOff = EditorConfig.colOffset;
+    int oldRowOff = EditorConfig.rowOffset;
+    
+    char *query = editorPrompt("Search: %s (ESC/Arrows/Enter)", editorFindCallback);
+    
+    if(query)
+        free(query);
+    else{
+        EditorConfig.cursorX = oldCursorX;
+        EditorConfig.cursorY = oldCursorY;
+        EditorConfig.colOffset = oldColOff;
+        EditorConfig.rowOffset = oldRowOff;
+    }
 }
 
-///// EDITOR OPERATIONS /////
+// Replaces every occurrence of query in one pass over the buffer. Each changed
+// row is rebuilt in a single allocation and each run of consecutive changed
+// rows is highlighted once. Returns the number of replacements.
+int editorReplaceAll(const char *query, const char *replacement){
+    int queryLength = strlen(query);
+    int replacementLength = strlen(replacement);
+    if(queryLength == 0)
+        return 0;
+    
+    int *matches = NULL;
+    int matchCapacity = 0;
+    int replaced = 0;
+    int regionStart = -1;
+    for(int i = 0; i <= EditorConfig.numRows; i++){
+        if(i % kPageBlockRows == 0)
+            editorPageTrim();
+        int numMatches = 0;
+        editorRow *row = i < EditorConfig.numRows ? &EditorConfig.rows[i] : NULL;
+        int paged = row ? editorRowPeek(row) : 0;
+        int match = row ? editorRowFind(row, query, queryLength, 0) : -1;
+        while(match != -1){
+            if(numMatches == matchCapacity){
+                matchCapacity = matchCapacity ? matchCapacity * 2 : 64;
+                matches = editorRealloc(MEM_SEARCH, matches, sizeof(int) * matchCapacity);
+            }
+            matches[numMatches++] = match;
+            match = editorRowFind(row, query, queryLength, match + queryLength);
+        }
+        
+        if(numMatches == 0){
+            if(regionStart != -1)
+                editorUpdateSyntaxRange(&EditorConfig.rows[regionStart], i - 1);
+            regionStart = -1;
+            if(paged)
+                editorRowEvict(row);
+            continue;
+        }
+        
+        int size = row->size + numMatches * (replacementLength - queryLength);
+        char *chars = editorCharsAlloc(size + 1);
+        int from = 0;
+        int to = 0;
+        for(int m = 0; m < numMatches; m++){
+            memcpy(&chars[to], &row->chars[from], matches[m] - from);
+            to += matches[m] - from;
+            memcpy(&chars[to], replacement, replacementLength);
+            to += replacementLength;
+            from = matches[m] + queryLength;
+        }
+        memcpy(&chars[to], &row->chars[from], row->size - from);
+        editorRowSetChars(row, chars, size);
+        
+        replaced += numMatches;
+        if(regionStart == -1)
+            regionStart = i;
+    }
+    editorFree(MEM_SEARCH, matches);
+    return replaced;
+}
 
-void editorInsertChar(int c){
-    if(EditorConfig.cursorY == EditorConfig.numRows)
-        editorInsertRow(EditorConfig.numRows, "", 0);
-    editorRowInsertChar(&EditorConfig.rows[EditorConfig.cursorY], EditorConfig.cursorX, c);
-    EditorConfig.cursorX++;
+void editorReplace(){
+    char *query = editorPrompt("Replace: %s (ESC to cancel)", NULL);
+    if(query == NULL)
+        return;
+    char *replacement = editorPrompt("Replace with: %s (ESC to cancel)", NULL);
+    if(replacement == NULL){
+        free(query);
+        return;
+    }
+    
+    int replaced = editorReplaceAll(query, replacement);
+    EditorConfig.searchMatchRow = -1;
+    if(EditorConfig.cursorY < EditorConfig.numRows){
+        editorRow *row = &EditorConfig.rows[EditorConfig.cursorY];
+        editorRowLoad(row);
+        if(EditorConfig.cursorX > row->size)
+            EditorConfig.cursorX = row->size;
+        while(EditorConfig.cursorX > 0 && (row->chars[EditorConfig.cursorX] & 0xC0) == 0x80)
+            EditorConfig.cursorX--;
+    }
+    editorSetStatusMessage("Replaced %d occurrences", replaced);
+    free(query);
+    free(replacement);
+}
+
+///// CRAWL /////
+
+// Queues an item on queue q of the crawl
+void editorCrawlPush(editorCrawl *crawl, int q, char *path, int isDir){
+    __atomic_add_fetch(&crawl->outstanding, 1, __ATOMIC_RELAXED);
+    editorCrawlQueue *queue = &crawl->queues[q];
+    pthread_mutex_lock(&queue->lock);
+    if(queue->tail == queue->capacity){
+        if(queue->head > 0){
+            memmove(queue->items, &queue->items[queue->head], sizeof(editorCrawlItem) * (queue->tail - queue->head));
+            queue->tail -= queue->head;
+            queue->head = 0;
+        }
+        else{
+            queue->capacity = queue->capacity ? queue->capacity * 2 : 256;
+            queue->items = realloc(queue->items, sizeof(editorCrawlItem) * queue->capacity);
+        }
+    }
+    queue->items[queue->tail].path = path;
+    queue->items[queue->tail].isDir = isDir;
+    queue->tail++;
+    pthread_mutex_unlock(&queue->lock);
+    
+    // A waiter counts itself idle before it checks pushes, so either it sees
+    // this push or it is counted here
+    __atomic_add_fetch(&crawl->pushes, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&crawl->idle, __ATOMIC_SEQ_CST)){
+        pthread_mutex_lock(&crawl->idleLock);
+        pthread_cond_signal(&crawl->idleCond);
+        pthread_mutex_unlock(&crawl->idleLock);
+    }
+}
+
+// Parks an idle thread until something is pushed after seen or the crawl is over
+void editorCrawlWait(editorCrawl *crawl, long seen){
+    pthread_mutex_lock(&crawl->idleLock);
+    __atomic_add_fetch(&crawl->idle, 1, __ATOMIC_SEQ_CST);
+    while(__atomic_load_n(&crawl->pushes, __ATOMIC_SEQ_CST) == seen &&
+          __atomic_load_n(&crawl->outstanding, __ATOMIC_SEQ_CST) != 0)
+        pthread_cond_wait(&crawl->idleCond, &crawl->idleLock);
+    __atomic_sub_fetch(&crawl->idle, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&crawl->idleLock);
+}
+
+// Takes the newest item of queue q for its owner, or the oldest for a thief,
+// as older items tend to be directories near the root with more work below
+int editorCrawlPop(editorCrawl *crawl, int q, int steal, editorCrawlItem *item){
+    editorCrawlQueue *queue = &crawl->queues[q];
+    pthread_mutex_lock(&queue->lock);
+    int found = queue->head < queue->tail;
+    if(found && steal)
+        *item = queue->items[queue->head++];
+    else if(found)
+        *item = queue->items[--queue->tail];
+    if(queue->head == queue->tail)
+        queue->head = queue->tail = 0;
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+int editorCrawlCancelled(editorCrawl *crawl){
+    return __atomic_load_n(&crawl->cancel, __ATOMIC_RELAXED);
+}
+
+void editorCrawlCancel(editorCrawl *crawl){
+    __atomic_store_n(&crawl->cancel, 1, __ATOMIC_RELAXED);
+}
+
+// Joins path and name, leaving out the root "."
+char *editorCrawlJoin(const char *path, const char *name){
+    char *child = malloc(strlen(path) + strlen(name) + 2);
+    if(!strcmp(path, "."))
+        strcpy(child, name);
+    else
+        sprintf(child, "%s/%s", path, name);
+    return child;
+}
+
+// DT_DIR, DT_REG or DT_UNKNOWN for anything else, such as symlinks
+int editorCrawlType(const char *path, int type){
+    if(type == DT_UNKNOWN){
+        struct stat st;
+        if(lstat(path, &st) == -1)
+            return DT_UNKNOWN;
+        type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+    }
+    return (type == DT_DIR || type == DT_REG) ? type : DT_UNKNOWN;
+}
+
+// Queues the entries of a directory on queue q, skipping hidden ones and symlinks
+void editorCrawlDirectory(editorCrawl *crawl, int q, const char *path){
+    DIR *dir = opendir(path);
+    if(dir == NULL)
+        return;
+    struct dirent *entry;
+    while((entry = readdir(dir)) && !editorCrawlCancelled(crawl)){
+        if(entry->d_name[0] == '.')
+            continue;
+        char *child = editorCrawlJoin(path, entry->d_name);
+        int type = editorCrawlType(child, entry->d_type);
+        if(type == DT_UNKNOWN)
+            free(child);
+        else
+            editorCrawlPush(crawl, q, child, type == DT_DIR);
+    }
+    closedir(dir);
+}
+
+// Works through its own queue, then steals from the others until nothing is
+// queued or being visited anywhere
+void *editorCrawlThread(void *arg){
+    editorCrawlQueue *queue = arg;
+    editorCrawl *crawl = queue->crawl;
+    int q = queue - crawl->queues;
+    char *buffer = malloc(kSearchMapMin);
+    while(1){
+        long seen = __atomic_load_n(&crawl->pushes, __ATOMIC_SEQ_CST);
+        editorCrawlItem item;
+        int found = editorCrawlPop(crawl, q, 0, &item);
+        for(int i = 1; !found && i < crawl->numThreads; i++)
+            found = editorCrawlPop(crawl, (q + i) % crawl->numThreads, 1, &item);
+        if(!found){
+            if(__atomic_load_n(&crawl->outstanding, __ATOMIC_ACQUIRE) == 0)
+                break;
+            editorCrawlWait(crawl, seen);
+            continue;
+        }
+        
+        // Once cancelled, queued items are only drained
+        if(!editorCrawlCancelled(crawl))
+            crawl->visit(crawl, q, &item, buffer);
+        free(item.path);
+        if(__atomic_sub_fetch(&crawl->outstanding, 1, __ATOMIC_SEQ_CST) == 0){
+            pthread_mutex_lock(&crawl->idleLock);
+            pthread_cond_broadcast(&crawl->idleCond);
+            pthread_mutex_unlock(&crawl->idleLock);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+void editorCrawlInit(editorCrawl *crawl, void (*visit)(editorCrawl *, int, editorCrawlItem *, char *)){
+    crawl->visit = visit;
+    crawl->outstanding = 0;
+    crawl->cancel = 0;
+    pthread_mutex_init(&crawl->idleLock, NULL);
+    pthread_cond_init(&crawl->idleCond, NULL);
+    crawl->pushes = 0;
+    crawl->idle = 0;
+    for(int i = 0; i < SEARCH_MAX_THREADS; i++){
+        pthread_mutex_init(&crawl->queues[i].lock, NULL);
+        crawl->queues[i].crawl = crawl;
+        crawl->queues[i].items = NULL;
+        crawl->queues[i].head = 0;
+        crawl->queues[i].tail = 0;
+        crawl->queues[i].capacity = 0;
+    }
+}
+
+// Visits the tree under the working directory with one thread per CPU and
+// returns once every thread has exited. Queues of threads that couldn't be
+// started stay empty, as only their owner pushes to them; the threads that
+// did start steal the rest, or the calling thread crawls alone.
+void editorCrawlRun(editorCrawl *crawl){
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    crawl->numThreads = cpus < 1 ? 1 : cpus > SEARCH_MAX_THREADS ? SEARCH_MAX_THREADS : cpus;
+    crawl->cancel = 0;
+    editorCrawlPush(crawl, 0, strdup("."), 1);
+    int started = 0;
+    while(started < crawl->numThreads &&
+          pthread_create(&crawl->threads[started], NULL, editorCrawlThread, &crawl->queues[started]) == 0)
+        started++;
+    if(started == 0)
+        editorCrawlThread(&crawl->queues[0]);
+    for(int i = 0; i < started; i++)
+        pthread_join(crawl->threads[i], NULL);
+}
+
+///// PROJECT SEARCH /////
+
+void editorSearchAddResult(editorSearchResult **results, int *count, int *capacity,
+                           const char *path, int line, int col, const char *text, int length){
+    if(*count == *capacity){
+        *capacity = *capacity ? *capacity * 2 : 16;
+        *results = realloc(*results, sizeof(editorSearchResult) * *capacity);
+    }
+    editorSearchResult *result = &(*results)[(*count)++];
+    result->path = strdup(path);
+    result->line = line;
+    result->col = col;
+    
+    while(length > 0 && (*text == ' ' || *text == '\t')){
+        text++;
+        length--;
+    }
+    if(length > kSearchTextMax)
+        length = kSearchTextMax;
+    while(length > 0 && text[length - 1] == '\r')
+        length--;
+    result->text = malloc(length + 1);
+    for(int i = 0; i < length; i++)
+        result->text[i] = ((unsigned char)text[i] < 32 || text[i] == 127) ? ' ' : text[i];
+    result->text[length] = '\0';
+}
+
+// Scans one file with memmem, reporting each matching line once. Files under
+// kSearchMapMin are read into buffer, which has room for kSearchMapMin bytes.
+void editorSearchFile(const char *path, char *buffer){
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+        return;
+    struct stat st;
+    if(fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0){
+        close(fd);
+        return;
+    }
+    size_t size = st.st_size;
+    char *data = buffer;
+    if(size < kSearchMapMin){
+        ssize_t n = read(fd, buffer, size);
+        size = n > 0 ? n : 0;
+    }
+    else{
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data != MAP_FAILED)
+            madvise(data, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    if(data == MAP_FAILED || size == 0)
+        return;
+    
+    size_t probe = size < kSearchBinaryProbe ? size : kSearchBinaryProbe;
+    editorSearchResult *results = NULL;
+    int count = 0;
+    int capacity = 0;
+    if(memchr(data, '\0', probe) == NULL){
+        const char *end = data + size;
+        const char *p = data;
+        const char *lineStart = data; // Start of the line holding p
+        int line = 0;
+        char *match;
+        while(p < end && (match = memmem(p, end - p, ProjectSearch.query, ProjectSearch.queryLength))){
+            char *newline;
+            while((newline = memchr(lineStart, '\n', match - lineStart))){
+                line++;
+                lineStart = newline + 1;
+            }
+            const char *lineEnd = memchr(match, '\n', end - match);
+            if(lineEnd == NULL)
+                lineEnd = end;
+            editorSearchAddResult(&results, &count, &capacity, path, line, match - lineStart, lineStart, lineEnd - lineStart);
+            p = lineEnd;
+        }
+    }
+    if(data != buffer)
+        munmap(data, size);
+    __atomic_add_fetch(&ProjectSearch.filesSearched, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ProjectSearch.bytesSearched, size, __ATOMIC_RELAXED);
+    if(count == 0)
+        return;
+    
+    pthread_mutex_lock(&ProjectSearch.lock);
+    if(ProjectSearch.numResults + count > kSearchMaxResults){
+        ProjectSearch.truncated = 1;
+        editorCrawlCancel(&ProjectSearch.crawl);
+        for(int i = kSearchMaxResults - ProjectSearch.numResults; i < count; i++){
+            free(results[i].path);
+            free(results[i].text);
+        }
+        count = kSearchMaxResults - ProjectSearch.numResults;
+    }
+    if(ProjectSearch.numResults + count > ProjectSearch.resultsCapacity){
+        while(ProjectSearch.numResults + count > ProjectSearch.resultsCapacity)
+            ProjectSearch.resultsCapacity = ProjectSearch.resultsCapacity ? ProjectSearch.resultsCapacity * 2 : 256;
+        ProjectSearch.results = editorRealloc(MEM_SEARCH, ProjectSearch.results, sizeof(editorSearchResult) * ProjectSearch.resultsCapacity);
+    }
+    memcpy(&ProjectSearch.results[ProjectSearch.numResults], results, sizeof(editorSearchResult) * count);
+    ProjectSearch.numResults += count;
+    pthread_mutex_unlock(&ProjectSearch.lock);
+    free(results);
+}
+
+void editorSearchVisit(editorCrawl *crawl, int q, editorCrawlItem *item, char *buffer){
+    if(item->isDir)
+        editorCrawlDirectory(crawl, q, item->path);
+    else
+        editorSearchFile(item->path, buffer);
+}
+
+// Runs on a thread of its own for the length of the search
+void editorSearchRun(editorTask *task){
+    (void)task;
+    editorCrawlRun(&ProjectSearch.crawl);
+}
+
+void editorSearchFreeResults(){
+    for(int i = 0; i < ProjectSearch.numResults; i++){
+        free(ProjectSearch.results[i].path);
+        free(ProjectSearch.results[i].text);
+    }
+    editorFree(MEM_SEARCH, ProjectSearch.results);
+    ProjectSearch.results = NULL;
+    ProjectSearch.numResults = 0;
+    ProjectSearch.resultsCapacity = 0;
+    free(ProjectSearch.query);
+    ProjectSearch.query = NULL;
+}
+
+// Updates the list and the message bar with the results found so far
+void editorSearchShowProgress(){
+    pthread_mutex_lock(&ProjectSearch.lock);
+    EditorConfig.listCount = ProjectSearch.numResults;
+    pthread_mutex_unlock(&ProjectSearch.lock);
+    
+    long long files = __atomic_load_n(&ProjectSearch.filesSearched, __ATOMIC_RELAXED);
+    if(ProjectSearch.running)
+        editorSetStatusMessage("%d matches in %lld files, searching... (ESC/Arrows/Enter)", EditorConfig.listCount, files);
+    else
+        editorSetStatusMessage("%d matches in %lld files, %lld ms%s (ESC/Arrows/Enter)", EditorConfig.listCount, files,
+                               ProjectSearch.elapsed, ProjectSearch.truncated ? ", stopped at the limit" : "");
+}
+
+void editorSearchTimer(){
+    if(!ProjectSearch.listOpen)
+        return;
+    editorSearchShowProgress();
+    EditorEvents.redraw = 1;
+    if(ProjectSearch.running)
+        editorTimerSchedule(&ProjectSearch.timer, kSearchRefreshMs);
+}
+
+void editorSearchDone(editorTask *task){
+    (void)task;
+    ProjectSearch.running = 0;
+    ProjectSearch.elapsed = editorNow() - ProjectSearch.started;
+    if(ProjectSearch.listOpen)
+        editorSearchShowProgress();
+    else
+        editorSearchFreeResults();
+}
+
+// Formats result index as path:line: text
+int editorSearchLine(int index, char *buf, int size){
+    pthread_mutex_lock(&ProjectSearch.lock);
+    editorSearchResult *result = &ProjectSearch.results[index];
+    int len = snprintf(buf, size, "%s:%d: %s", result->path, result->line + 1, result->text);
+    pthread_mutex_unlock(&ProjectSearch.lock);
+    return len < size ? len : size - 1;
+}
+
+void editorInitProjectSearch(){
+    pthread_mutex_init(&ProjectSearch.lock, NULL);
+    editorCrawlInit(&ProjectSearch.crawl, editorSearchVisit);
+    ProjectSearch.running = 0;
+    ProjectSearch.listOpen = 0;
+    ProjectSearch.query = NULL;
+    ProjectSearch.results = NULL;
+    ProjectSearch.numResults = 0;
+    ProjectSearch.resultsCapacity = 0;
+    ProjectSearch.timer.callback = editorSearchTimer;
+    ProjectSearch.timer.pending = 0;
+}
+
+// Searches every file under the working directory for a literal string and
+// lists the matching lines as they are found. Enter opens the selected one.
+void editorProjectSearch(){
+    if(ProjectSearch.running){
+        editorSetStatusMessage("The last search is still stopping");
+        return;
+    }
+    char *query = editorPrompt("Search project: %s (ESC to cancel)", NULL);
+    if(query == NULL)
+        return;
+    
+    ProjectSearch.query = query;
+    ProjectSearch.queryLength = strlen(query);
+    ProjectSearch.truncated = 0;
+    ProjectSearch.filesSearched = 0;
+    ProjectSearch.bytesSearched = 0;
+    ProjectSearch.started = editorNow();
+    ProjectSearch.running = 1;
+    ProjectSearch.listOpen = 1;
+    ProjectSearch.task.run = editorSearchRun;
+    ProjectSearch.task.done = editorSearchDone;
+    editorSpawnTask(&ProjectSearch.task);
+    editorTimerSchedule(&ProjectSearch.timer, kSearchRefreshMs);
+    
+    EditorConfig.listActive = 1;
+    EditorConfig.listCount = 0;
+    EditorConfig.listSelected = 0;
+    EditorConfig.listOffset = 0;
+    EditorConfig.listLine = editorSearchLine;
+    
+    char *path = NULL;
+    int line = 0;
+    int col = 0;
+    while(1){
+        editorSearchShowProgress();
+        editorRefreshScreen();
+        
+        int c = editorReadKey();
+        if(c == '\x1b')
+            break;
+        else if(c == '\r' && EditorConfig.listCount > 0){
+            pthread_mutex_lock(&ProjectSearch.lock);
+            editorSearchResult *result = &ProjectSearch.results[EditorConfig.listSelected];
+            path = strdup(result->path);
+            line = result->line;
+            col = result->col;
+            pthread_mutex_unlock(&ProjectSearch.lock);
+            break;
+        }
+        else
+            editorListMove(c);
+    }
+    
+    EditorConfig.listActive = 0;
+    ProjectSearch.listOpen = 0;
+    editorTimerCancel(&ProjectSearch.timer);
+    editorSetStatusMessage("");
+    if(ProjectSearch.running)
+        editorCrawlCancel(&ProjectSearch.crawl);
+    else
+        editorSearchFreeResults();
+    
+    if(path){
+        editorOpenAt(path, line, col);
+        free(path);
+    }
+}
+
+///// FILE OPENER /////
+
+// Adds a listed directory to the results of the crawl
+void editorIndexAddDir(editorIndexDir *dir){
+    pthread_mutex_lock(&FileIndex.lock);
+    if(FileIndex.numDirs == FileIndex.dirsCapacity){
+        FileIndex.dirsCapacity = FileIndex.dirsCapacity ? FileIndex.dirsCapacity * 2 : 256;
+        FileIndex.dirs = realloc(FileIndex.dirs, sizeof(editorIndexDir) * FileIndex.dirsCapacity);
+    }
+    FileIndex.dirs[FileIndex.numDirs++] = *dir;
+    pthread_mutex_unlock(&FileIndex.lock);
+}
+
+int editorIndexDirCompare(const void *a, const void *b){
+    return strcmp(((const editorIndexDir *)a)->path, ((const editorIndexDir *)b)->path);
+}
+
+// Record of path in the last complete crawl, which is sorted by path
+editorIndexDir *editorIndexFindKnown(const char *path){
+    editorIndexDir key;
+    key.path = (char *)path;
+    return bsearch(&key, FileIndex.known, FileIndex.numKnown, sizeof(editorIndexDir), editorIndexDirCompare);
+}
+
+// Lists a directory, reusing its entries from the last crawl when its mtime
+// is unchanged, and queues its subdirectories
+void editorIndexVisit(editorCrawl *crawl, int q, editorCrawlItem *item, char *buffer){
+    (void)buffer;
+    struct stat st;
+    if(stat(item->path, &st) == -1)
+        return;
+    
+    editorIndexDir dir;
+    dir.path = strdup(item->path);
+    dir.mtimeSec = st.st_mtim.tv_sec;
+    dir.mtimeNsec = st.st_mtim.tv_nsec;
+    dir.names = NULL;
+    dir.namesLength = 0;
+    
+    editorIndexDir *known = editorIndexFindKnown(item->path);
+    if(known && known->mtimeSec == dir.mtimeSec && known->mtimeNsec == dir.mtimeNsec){
+        dir.names = malloc(known->namesLength);
+        memcpy(dir.names, known->names, known->namesLength);
+        dir.namesLength = known->namesLength;
+    }
+    else{
+        DIR *d = opendir(item->path);
+        if(d == NULL){
+            free(dir.path);
+            return;
+        }
+        int capacity = 0;
+        struct dirent *entry;
+        while((entry = readdir(d))){
+            if(entry->d_name[0] == '.')
+                continue;
+            int type = entry->d_type;
+            if(type == DT_UNKNOWN){
+                char *child = editorCrawlJoin(item->path, entry->d_name);
+                type = editorCrawlType(child, type);
+                free(child);
+            }
+            else
+                type = editorCrawlType(NULL, type);
+            if(type == DT_UNKNOWN)
+                continue;
+            
+            int length = strlen(entry->d_name);
+            if(dir.namesLength + length + 2 > capacity){
+                capacity = (dir.namesLength + length + 2) * 2;
+                dir.names = realloc(dir.names, capacity);
+            }
+            dir.names[dir.namesLength] = (type == DT_DIR) ? 'd' : 'f';
+            memcpy(&dir.names[dir.namesLength + 1], entry->d_name, length + 1);
+            dir.namesLength += length + 2;
+        }
+        closedir(d);
+    }
+    
+    for(int i = 0; i < dir.namesLength; i += strlen(&dir.names[i + 1]) + 2)
+        if(dir.names[i] == 'd')
+            editorCrawlPush(crawl, q, editorCrawlJoin(item->path, &dir.names[i + 1]), 1);
+    editorIndexAddDir(&dir);
+}
+
+// Letters and digits get a bit each, other bytes share the next ones and
+// the top bit marks an uppercase letter
+uint64_t editorPathMask(const char *s, int length){
+    uint64_t mask = 0;
+    for(int i = 0; i < length; i++){
+        unsigned char c = FileIndex.lower[(unsigned char)s[i]];
+        if(c != (unsigned char)s[i])
+            mask |= kPathMaskUpper;
+        if(c >= 'a' && c <= 'z')
+            mask |= 1ULL << (c - 'a');
+        else if(c >= '0' && c <= '9')
+            mask |= 1ULL << (26 + c - '0');
+        else
+            mask |= 1ULL << (36 + c % 27);
+    }
+    return mask;
+}
+
+void editorPathIndexFree(editorPathIndex *index){
+    free(index->paths);
+    free(index->offsets);
+    free(index->masks);
+    memset(index, 0, sizeof(*index));
+}
+
+// Flattens the files of dirs into one block of NUL-terminated paths, with
+// the offset and character mask of each
+void editorPathIndexBuild(editorPathIndex *index, editorIndexDir *dirs, int numDirs){
+    size_t length = 0;
+    int count = 0;
+    for(int d = 0; d < numDirs; d++){
+        size_t prefix = strcmp(dirs[d].path, ".") ? strlen(dirs[d].path) + 1 : 0;
+        for(int i = 0; i < dirs[d].namesLength; i += strlen(&dirs[d].names[i + 1]) + 2){
+            if(dirs[d].names[i] == 'f'){
+                length += prefix + strlen(&dirs[d].names[i + 1]) + 1;
+                count++;
+            }
+        }
+    }
+    
+    index->length = length;
+    index->paths = malloc(length ? length : 1);
+    index->offsets = malloc(sizeof(uint32_t) * (count ? count : 1));
+    index->masks = malloc(sizeof(uint64_t) * (count ? count : 1));
+    index->numPaths = 0;
+    char *p = index->paths;
+    for(int d = 0; d < numDirs; d++){
+        int root = !strcmp(dirs[d].path, ".");
+        for(int i = 0; i < dirs[d].namesLength; i += strlen(&dirs[d].names[i + 1]) + 2){
+            if(dirs[d].names[i] != 'f')
+                continue;
+            char *start = p;
+            if(!root){
+                strcpy(p, dirs[d].path);
+                p += strlen(p);
+                *p++ = '/';
+            }
+            strcpy(p, &dirs[d].names[i + 1]);
+            p += strlen(p) + 1;
+            index->offsets[index->numPaths] = start - index->paths;
+            index->masks[index->numPaths++] = editorPathMask(start, p - start - 1);
+        }
+    }
+}
+
+void editorIndexFreeDirs(editorIndexDir *dirs, int numDirs){
+    for(int d = 0; d < numDirs; d++){
+        free(dirs[d].path);
+        free(dirs[d].names);
+    }
+    free(dirs);
 }
 
-void editorDelChar(){
-    if(EditorConfig.cursorY == EditorConfig.numRows)
+// $XDG_CACHE_HOME/kbeditor/<hash of the working directory>.paths
+int editorIndexPath(char *buf, size_t size){
+    if(!editorCachePath(buf, size, "."))
+        return 0;
+    strncat(buf, ".paths", size - strlen(buf) - 1);
+    return 1;
+}
+
+// Header "KBPATHS1", the number of directories, then for each one its mtime,
+// path length, names length, path and names
+void editorIndexStore(editorIndexDir *dirs, int numDirs){
+    char path[1100];
+    if(!editorIndexPath(path, sizeof(path)))
         return;
-    if(EditorConfig.cursorX == 0 && EditorConfig.cursorY == 0)
+    char tmp[1110];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(tmp, "w");
+    if(fp == NULL)
         return;
-    
-    editorRow *row = &EditorConfig.rows[EditorConfig.cursorY];
-    if(EditorConfig.cursorX > 0)
-        editorRowDelChar(row, --EditorConfig.cursorX);
-    else{
-        EditorConfig.cursorX = EditorConfig.rows[EditorConfig.cursorY - 1].size;
-        editorRowAppendString(&EditorConfig.rows[EditorConfig.cursorY - 1], row->chars, row->size);
-        editorDelRow(EditorConfig.cursorY--);
+    uint64_t count = numDirs;
+    fwrite("KBPATHS1", 1, 8, fp);
+    fwrite(&count, sizeof(count), 1, fp);
+    for(int d = 0; d < numDirs; d++){
+        uint32_t lengths[2] = {strlen(dirs[d].path), dirs[d].namesLength};
+        fwrite(&dirs[d].mtimeSec, sizeof(int64_t), 1, fp);
+        fwrite(&dirs[d].mtimeNsec, sizeof(int64_t), 1, fp);
+        fwrite(lengths, sizeof(lengths), 1, fp);
+        fwrite(dirs[d].path, 1, lengths[0], fp);
+        fwrite(dirs[d].names, 1, lengths[1], fp);
     }
+    // Written aside and renamed so a reader never sees a partial index
+    if(fclose(fp) == 0)
+        rename(tmp, path);
+    else
+        unlink(tmp);
 }
 
-void editorInsertNewLine(){
-    if(EditorConfig.cursorX == 0)
-        editorInsertRow(EditorConfig.cursorY, "", 0);
-    else{
-        editorRow *row = &EditorConfig.rows[EditorConfig.cursorY];
-        editorInsertRow(EditorConfig.cursorY + 1, &row->chars[EditorConfig.cursorX], row->size - EditorConfig.cursorX);
-        row = &EditorConfig.rows[EditorConfig.cursorY];
-        row->size = EditorConfig.cursorX;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+// Reads the index left by the last session into FileIndex.known
+void editorIndexLoad(){
+    char path[1100];
+    if(!editorIndexPath(path, sizeof(path)))
+        return;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+        return;
+    struct stat st;
+    char *data = (fstat(fd, &st) == 0 && st.st_size >= 16) ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if(data == MAP_FAILED)
+        return;
+    
+    size_t size = st.st_size;
+    uint64_t count;
+    memcpy(&count, &data[8], sizeof(count));
+    if(memcmp(data, "KBPATHS1", 8) || count > size / 24){
+        munmap(data, size);
+        return;
     }
-    EditorConfig.cursorY++;
-    EditorConfig.cursorX = 0;
+    editorIndexDir *dirs = malloc(sizeof(editorIndexDir) * (count ? count : 1));
+    int numDirs = 0;
+    size_t pos = 16;
+    while((uint64_t)numDirs < count && pos + 24 <= size){
+        editorIndexDir *dir = &dirs[numDirs];
+        uint32_t lengths[2];
+        memcpy(&dir->mtimeSec, &data[pos], sizeof(int64_t));
+        memcpy(&dir->mtimeNsec, &data[pos + 8], sizeof(int64_t));
+        memcpy(lengths, &data[pos + 16], sizeof(lengths));
+        pos += 24;
+        if(pos + lengths[0] + lengths[1] > size || (lengths[1] && data[pos + lengths[0] + lengths[1] - 1] != '\0'))
+            break;
+        dir->path = strndup(&data[pos], lengths[0]);
+        dir->names = malloc(lengths[1] ? lengths[1] : 1);
+        memcpy(dir->names, &data[pos + lengths[0]], lengths[1]);
+        dir->namesLength = lengths[1];
+        pos += lengths[0] + lengths[1];
+        numDirs++;
+    }
+    munmap(data, size);
+    
+    // Keep only whole records, in the order bsearch expects
+    qsort(dirs, numDirs, sizeof(editorIndexDir), editorIndexDirCompare);
+    FileIndex.known = dirs;
+    FileIndex.numKnown = numDirs;
 }
 
-///// FILE I/O /////
+// Runs on a thread of its own: crawls the tree, then persists and flattens it
+void editorIndexRun(editorTask *task){
+    (void)task;
+    editorCrawlRun(&FileIndex.crawl);
+    if(editorCrawlCancelled(&FileIndex.crawl))
+        return; // Partial, so neither stored nor used
+    qsort(FileIndex.dirs, FileIndex.numDirs, sizeof(editorIndexDir), editorIndexDirCompare);
+    editorIndexStore(FileIndex.dirs, FileIndex.numDirs);
+    editorPathIndexBuild(&FileIndex.next, FileIndex.dirs, FileIndex.numDirs);
+}
 
-char *editorRowsToString(int *bufferLength){
-    int totalLength = 0;
-    for(int j = 0; j < EditorConfig.numRows; j++)
-        totalLength += EditorConfig.rows[j].size + 1;
-    *bufferLength = totalLength;
-    
-    char *buffer = malloc(totalLength);
-    char *p = buffer;
-    for(int j = 0; j < EditorConfig.numRows; j++){
-        memcpy(p, EditorConfig.rows[j].chars, EditorConfig.rows[j].size);
-        p += EditorConfig.rows[j].size;
-        *p = '\n';
-        p++;
+// Puts the index built in the background in use
+void editorIndexSwap(){
+    editorPathIndexFree(&FileIndex.index);
+    FileIndex.index = FileIndex.next;
+    memset(&FileIndex.next, 0, sizeof(FileIndex.next));
+    FileIndex.numCandidates = -1;
+    if(EditorConfig.listActive && EditorConfig.listLine == editorOpenerLine){
+        editorIndexMatch(FileIndex.query ? FileIndex.query : "");
+        EditorEvents.redraw = 1;
     }
-    
-    return buffer;
 }
 
-void editorOpen(char *fileName){
-    free(EditorConfig.filename);
-    EditorConfig.filename = strdup(fileName);
-    
-    editorSelectSyntaxHighlight();
-    
-    FILE *fp = fopen(fileName, "r");
-    if(!fp)
-        die("fopen");
-    
-    char *line = NULL;
-    size_t lineCap = 0;
-    ssize_t lineLength;
-    while((lineLength = getline(&line, &lineCap, fp)) != -1){
-        while(lineLength > 0 && (line[lineLength - 1] == '\n' || line[lineLength - 1] == '\r'))
-            lineLength--;
-        editorInsertRow(EditorConfig.numRows, line, lineLength);
+void editorIndexDone(editorTask *task){
+    (void)task;
+    FileIndex.running = 0;
+    if(editorCrawlCancelled(&FileIndex.crawl)){
+        editorIndexFreeDirs(FileIndex.dirs, FileIndex.numDirs);
+        FileIndex.dirs = NULL;
+        FileIndex.numDirs = 0;
+        FileIndex.dirsCapacity = 0;
+        return;
     }
-    free(line);
-    fclose(fp);
-    EditorConfig.dirtyFlag = 0;
+    editorIndexFreeDirs(FileIndex.known, FileIndex.numKnown);
+    FileIndex.known = FileIndex.dirs;
+    FileIndex.numKnown = FileIndex.numDirs;
+    FileIndex.dirs = NULL;
+    FileIndex.numDirs = 0;
+    FileIndex.dirsCapacity = 0;
+    editorIndexSwap();
 }
 
-void editorSave(){
-    if(EditorConfig.filename == NULL){
-        EditorConfig.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-        if(EditorConfig.filename == NULL){
-            editorSetStatusMessage("Save aborted");
-            return;
-        }
-        editorSelectSyntaxHighlight();
+// Reads the index of the last session off the main thread
+void editorIndexLoadRun(editorTask *task){
+    (void)task;
+    editorIndexLoad();
+    editorPathIndexBuild(&FileIndex.next, FileIndex.known, FileIndex.numKnown);
+}
+
+// Shows the loaded index, then brings it up to date with a crawl
+void editorIndexLoadDone(editorTask *task){
+    (void)task;
+    editorIndexSwap();
+    editorSpawnTask(&FileIndex.task);
+}
+
+// Next byte in [p, end) that equals the lowercase c, in either case when
+// the path has uppercase letters
+const char *editorFindFolded(const char *p, const char *end, unsigned char c, int folded){
+    const char *found = memchr(p, c, end - p);
+    if(folded && c >= 'a' && c <= 'z'){
+        const char *upper = memchr(p, c - 'a' + 'A', (found ? found : end) - p);
+        if(upper)
+            found = upper;
     }
+    return found;
+}
+
+// Scores the lowercase query as a subsequence of path, or returns INT_MIN.
+// Matches are taken greedily with memchr, from the file name when it holds
+// the whole query.
+int editorPathScore(const char *path, int length, const char *query, int folded){
+    const char *end = path + length;
+    const char *name = memrchr(path, '/', length);
+    name = name ? name + 1 : path;
     
-    int length;
-    char *buffer = editorRowsToString(&length);
-    
-    int fd = open(EditorConfig.filename, O_RDWR | O_CREAT, 0644); // 0644 = Permissions
-    
-    if(fd != -1){
-        if(ftruncate(fd, length) != -1){
-            if(write(fd, buffer, length) == length){
-                close(fd);
-                free(buffer);
-                EditorConfig.dirtyFlag = 0;
-                editorSetStatusMessage("%d bytes written to disk.", length);
-                return;
-            }
+    const char *start = name;
+    while(1){
+        const char *last = NULL;
+        const char *q = query;
+        int score = 0;
+        for(const char *p = start; *q; p++, q++){
+            p = editorFindFolded(p, end, *q, folded);
+            if(p == NULL)
+                break;
+            score += 16;
+            if(last && p == last + 1)
+                score += 12; // Consecutive
+            else if(last)
+                score -= (p - last - 1) < 8 ? (p - last - 1) : 8; // Gap
+            if(p == path || FileIndex.wordStart[(unsigned char)p[-1]] ||
+               (islower((unsigned char)p[-1]) && isupper((unsigned char)*p)))
+                score += 10; // Start of a word
+            if(p >= name)
+                score += 8;
+            last = p;
         }
-        close(fd);
+        if(*q == '\0')
+            return score - length / 4;
+        if(start == path)
+            return INT_MIN;
+        start = path;
     }
-    free(buffer);
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
 }
 
-///// FIND /////
-
-void editorFindCallback(char *query, int key){
-    static int lastMatch = -1;
-    static int direction = 1;
-    
-    static int savedHlLine;
-    static char *savedHl = NULL;
+// Best OPENER_MAX_RESULTS paths for query, best first, into FileIndex.matches.
+// A query that extends the previous one only rescans the previous candidates.
+void editorIndexMatch(const char *query){
+    editorPathIndex *index = &FileIndex.index;
+    int queryLength = strlen(query);
+    char lowered[256];
+    if(queryLength >= (int)sizeof(lowered))
+        queryLength = sizeof(lowered) - 1;
+    for(int i = 0; i < queryLength; i++)
+        lowered[i] = FileIndex.lower[(unsigned char)query[i]];
+    lowered[queryLength] = '\0';
+    uint64_t mask = editorPathMask(lowered, queryLength);
     
-    if(savedHl){
-        memcpy(EditorConfig.rows[savedHlLine].highlighting, savedHl, EditorConfig.rows[savedHlLine].renderSize);
-        free(savedHl);
-        savedHl = NULL;
-    }
-    
-    if(key == '\r' || key == '\x1b'){
-        lastMatch = -1;
-        direction = 1;
-        return;
-    }
-    else if(key == ARROW_RIGHT || key == ARROW_DOWN)
-        direction = 1;
-    else if(key == ARROW_LEFT || key == ARROW_UP)
-        direction = -1;
-    else{
-        lastMatch = -1;
-        direction = 1;
+    int narrow = FileIndex.numCandidates >= 0 && FileIndex.query &&
+                 !strncmp(lowered, FileIndex.query, strlen(FileIndex.query));
+    if(FileIndex.candidates == NULL || FileIndex.candidatesCapacity < index->numPaths){
+        FileIndex.candidatesCapacity = index->numPaths;
+        FileIndex.candidates = realloc(FileIndex.candidates, sizeof(int) * (index->numPaths ? index->numPaths : 1));
     }
-    
-    if(lastMatch == -1)
-        direction = 1;
-    int current = lastMatch;
-    for(int i = 0; i < EditorConfig.numRows; i++){
-        current += direction;
-        if(current == -1)
-            current = EditorConfig.numRows - 1;
-        else if(current == EditorConfig.numRows)
-            current = 0;
+    int total = narrow ? FileIndex.numCandidates : index->numPaths;
+    int kept = 0;
+    FileIndex.numMatches = 0;
+    for(int c = 0; c < total; c++){
+        int i = narrow ? FileIndex.candidates[c] : c;
+        if((index->masks[i] & mask) != mask)
+            continue;
+        int length = ((i + 1 < index->numPaths) ? index->offsets[i + 1] : index->length) - index->offsets[i] - 1;
+        int score = editorPathScore(&index->paths[index->offsets[i]], length, lowered, (index->masks[i] & kPathMaskUpper) != 0);
+        if(score == INT_MIN)
+            continue;
+        FileIndex.candidates[kept++] = i;
         
-        editorRow *row = &EditorConfig.rows[current];
-        char *match = strstr(row->render, query);
-        if(match){
-            lastMatch = current;
-            EditorConfig.cursorY = current;
-            EditorConfig.cursorX = editorRowRenderToCursor(row, match - row->render);
-            EditorConfig.rowOffset = EditorConfig.numRows;
-            
-            savedHlLine = current;
-            savedHl = malloc(row->renderSize);
-            memcpy(savedHl, row->highlighting, row->renderSize);
-            memset(&row->highlighting[match - row->render], HL_MATCH, strlen(query));
-            break;
+        // Sorted insert into the bounded result list
+        int n = FileIndex.numMatches;
+        if(n == OPENER_MAX_RESULTS && score <= FileIndex.scores[n - 1])
+            continue;
+        if(n < OPENER_MAX_RESULTS)
+            FileIndex.numMatches++;
+        else
+            n--;
+        while(n > 0 && FileIndex.scores[n - 1] < score){
+            FileIndex.matches[n] = FileIndex.matches[n - 1];
+            FileIndex.scores[n] = FileIndex.scores[n - 1];
+            n--;
         }
+        FileIndex.matches[n] = i;
+        FileIndex.scores[n] = score;
     }
+    FileIndex.numCandidates = kept;
+    free(FileIndex.query);
+    FileIndex.query = strdup(lowered);
+    
+    EditorConfig.listCount = FileIndex.numMatches;
+    EditorConfig.listSelected = 0;
 }
 
-void editorFind(){
-    int oldCursorX = EditorConfig.cursorX;
-    int oldCursorY = EditorConfig.cursorY;
-    int oldColOff = EditorConfig.colOffset;
-    int oldRowOff = EditorConfig.rowOffset;
+int editorOpenerLine(int index, char *buf, int size){
+    const char *path = &FileIndex.index.paths[FileIndex.index.offsets[FileIndex.matches[index]]];
+    int len = snprintf(buf, size, "%s", path);
+    return len < size ? len : size - 1;
+}
+
+void editorOpenerCallback(char *query, int key){
+    if(key == '\r' && query[0] == '\0')
+        return; // The prompt only accepts a query
+    if(key == '\r' && EditorConfig.listCount > 0){
+        const char *path = &FileIndex.index.paths[FileIndex.index.offsets[FileIndex.matches[EditorConfig.listSelected]]];
+        FileIndex.chosen = strdup(path);
+    }
+    if(key == '\r' || key == '\x1b')
+        EditorConfig.listActive = 0;
+    else if(!editorListMove(key))
+        editorIndexMatch(query);
+}
+
+void editorInitFileIndex(){
+    for(int c = 0; c < 256; c++)
+        FileIndex.lower[c] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+    for(const char *c = "/_-. "; *c; c++)
+        FileIndex.wordStart[(unsigned char)*c] = 1;
+    pthread_mutex_init(&FileIndex.lock, NULL);
+    editorCrawlInit(&FileIndex.crawl, editorIndexVisit);
+    FileIndex.loadTask.run = editorIndexLoadRun;
+    FileIndex.loadTask.done = editorIndexLoadDone;
+    FileIndex.task.run = editorIndexRun;
+    FileIndex.task.done = editorIndexDone;
+    FileIndex.loaded = 0;
+    FileIndex.running = 0;
+    FileIndex.dirs = NULL;
+    FileIndex.numDirs = 0;
+    FileIndex.dirsCapacity = 0;
+    FileIndex.known = NULL;
+    FileIndex.numKnown = 0;
+    memset(&FileIndex.index, 0, sizeof(FileIndex.index));
+    memset(&FileIndex.next, 0, sizeof(FileIndex.next));
+    FileIndex.candidates = NULL;
+    FileIndex.candidatesCapacity = 0;
+    FileIndex.numCandidates = -1;
+    FileIndex.query = NULL;
+    FileIndex.numMatches = 0;
+    FileIndex.chosen = NULL;
+}
+
+// Fuzzy finder over the files under the working directory. The index from
+// the last session is shown at once while a crawl brings it up to date.
+void editorOpenFile(){
+    if(!FileIndex.running){
+        FileIndex.running = 1;
+        editorSpawnTask(FileIndex.loaded ? &FileIndex.task : &FileIndex.loadTask);
+        FileIndex.loaded = 1;
+    }
     
-    char *query = editorPrompt("Search: %s (ESC/Arrows/Enter)", editorFindCallback);
+    EditorConfig.listActive = 1;
+    EditorConfig.listOffset = 0;
+    EditorConfig.listLine = editorOpenerLine;
+    FileIndex.numCandidates = -1;
+    editorIndexMatch("");
     
-    if(query)
-        free(query);
-    else{
-        EditorConfig.cursorX = oldCursorX;
-        EditorConfig.cursorY = oldCursorY;
-        EditorConfig.colOffset = oldColOff;
-        EditorConfig.rowOffset = oldRowOff;
+    char *query = editorPrompt(FileIndex.index.numPaths ? "Open file: %s (ESC/Arrows/Enter)" : "Open file: %s (indexing...)",
+                               editorOpenerCallback);
+    EditorConfig.listActive = 0;
+    free(query);
+    if(FileIndex.chosen){
+        editorOpenAt(FileIndex.chosen, 0, 0);
+        free(FileIndex.chosen);
+        FileIndex.chosen = NULL;
     }
 }
 
@@ -733,7 +6190,7 @@ typedef struct aBuf {
 #define ABUF_INIT {NULL, 0}
 
 void abAppend(AppendBuffer *ab, const char *s, int len) {
-    char *new = realloc(ab->b, ab->len + len);
+    char *new = editorRealloc(MEM_APPEND, ab->b, ab->len + len);
     if (new == NULL) 
         return;
     memcpy(&new[ab->len], s, len);
@@ -742,7 +6199,7 @@ void abAppend(AppendBuffer *ab, const char *s, int len) {
 }
 
 void abFree(AppendBuffer *ab) {
-    free(ab->b);
+    editorFree(MEM_APPEND, ab->b);
 }
 
 ///// INPUT /////
@@ -760,8 +6217,10 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)){
         
         int c = editorReadKey();
         if(c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE){
-            if(bufferLength != 0)
-                buffer[--bufferLength] = '\0';
+            if(bufferLength != 0){
+                bufferLength = utf8PrevChar(buffer, bufferLength);
+                buffer[bufferLength] = '\0';
+            }
         }
         else if(c == '\x1b'){
             editorSetStatusMessage("");
@@ -778,7 +6237,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)){
                 return buffer;
             }
         }
-        else if(!iscntrl(c) && c < 128){
+        else if(c < 256 && (c >= 128 || !iscntrl(c))){
             if(bufferLength == bufferSize - 1){
                 bufferSize *= 2;
                 buffer = realloc(buffer, bufferSize);
@@ -792,59 +6251,146 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)){
     }
 }
 
+// Moves the selection of the list drawn over the rows; returns whether key was used
+int editorListMove(int key){
+    int selected = EditorConfig.listSelected;
+    if(key == ARROW_UP)
+        selected--;
+    else if(key == ARROW_DOWN)
+        selected++;
+    else if(key == PAGE_UP)
+        selected -= EditorConfig.screenRows;
+    else if(key == PAGE_DOWN)
+        selected += EditorConfig.screenRows;
+    else if(key == HOME_KEY)
+        selected = 0;
+    else if(key == END_KEY)
+        selected = EditorConfig.listCount - 1;
+    else
+        return 0;
+    if(selected >= EditorConfig.listCount)
+        selected = EditorConfig.listCount - 1;
+    if(selected < 0)
+        selected = 0;
+    EditorConfig.listSelected = selected;
+    return 1;
+}
+
 void editorMoveCursor(int key) {
     editorRow *row = (EditorConfig.cursorY >= EditorConfig.numRows) 
                     ? NULL 
                     : &EditorConfig.rows[EditorConfig.cursorY];
+    if(row)
+        editorRowLoad(row);
     
     switch (key) {
         case ARROW_LEFT:
             if(EditorConfig.cursorX != 0)
-                EditorConfig.cursorX--;
-            else if(EditorConfig.cursorY > 0)
-                EditorConfig.cursorX = EditorConfig.rows[--EditorConfig.cursorY].size;
+                EditorConfig.cursorX = utf8PrevChar(row->chars, EditorConfig.cursorX);
+            else if(EditorConfig.cursorY > 0){
+                EditorConfig.cursorY = editorPrevVisibleRow(EditorConfig.cursorY);
+                EditorConfig.cursorX = EditorConfig.rows[EditorConfig.cursorY].size;
+            }
             break;
         case ARROW_RIGHT:
             if(row && EditorConfig.cursorX < row->size)
-                EditorConfig.cursorX++;
+                EditorConfig.cursorX = utf8NextChar(row->chars, row->size, EditorConfig.cursorX);
             else if(row && EditorConfig.cursorX == row->size){
-                EditorConfig.cursorY++;
+                EditorConfig.cursorY = editorNextVisibleRow(EditorConfig.cursorY);
                 EditorConfig.cursorX = 0;
             }
             break;
         case ARROW_UP:
             if(EditorConfig.cursorY != 0)
-                EditorConfig.cursorY--;
+                EditorConfig.cursorY = editorPrevVisibleRow(EditorConfig.cursorY);
             break;
         case ARROW_DOWN:
             if(EditorConfig.cursorY < EditorConfig.numRows)
-                EditorConfig.cursorY++;
+                EditorConfig.cursorY = editorNextVisibleRow(EditorConfig.cursorY);
             break;
     }
     
     row = (EditorConfig.cursorY >= EditorConfig.numRows) 
         ? NULL 
         : &EditorConfig.rows[EditorConfig.cursorY];
+    if(row)
+        editorRowLoad(row);
     int rowLength = row ? row->size : 0;
     if(EditorConfig.cursorX > rowLength)
         EditorConfig.cursorX = rowLength;
+    // Vertical moves keep the byte offset, which may land inside a sequence
+    while(row && EditorConfig.cursorX > 0 && ((unsigned char)row->chars[EditorConfig.cursorX] & 0xC0) == 0x80)
+        EditorConfig.cursorX--;
+}
+
+int editorKeyEdits(int c){
+    return c == '\r' || c == BACKSPACE || c == CTRL_KEY('h') || c == DEL_KEY ||
+           c == CTRL_KEY('r') || c == CTRL_KEY('s') || c == CTRL_KEY('n') || c == '\t' || (c < 256 && (c >= 128 || !iscntrl(c)));
+}
+
+// Each press shows the next page of statistics
+void editorShowStats(){
+    static int page = 0;
+    char b[MEM_KINDS][16];
+    for(int k = 0; k < MEM_KINDS; k++)
+        editorFormatBytes(b[k], sizeof(b[k]), EditorMemory.bytes[k]);
+    // Frames are freed once written, so their largest size is what matters
+    editorFormatBytes(b[MEM_APPEND], sizeof(b[MEM_APPEND]), EditorMemory.peak[MEM_APPEND]);
+    
+    if(page == 0)
+        editorSetStatusMessage("Frames: %lld painted, %lld skipped | Keys: %lld | Last paint: %lld ms",
+                               EditorEvents.framesPainted, EditorEvents.framesSkipped,
+                               EditorEvents.keysProcessed, EditorEvents.paintMs);
+    else if(page == 1)
+        editorSetStatusMessage("Mem rows: chars %s render %s chunks %s hl %s array %s",
+                               b[MEM_CHARS], b[MEM_RENDER], b[MEM_CHUNKS], b[MEM_HIGHLIGHT], b[MEM_ROWS]);
+    else if(page == 2)
+        editorSetStatusMessage("Mem: frame %s find %s jnl %s snap %s brackets %s words %s",
+                               b[MEM_APPEND], b[MEM_SEARCH], b[MEM_JOURNAL], b[MEM_SNAPSHOT], b[MEM_BRACKETS], b[MEM_WORDS]);
+    else{
+        char text[16];
+        char tracked[16];
+        char untracked[16];
+        editorFormatBytes(text, sizeof(text), editorMemResidentText());
+        editorFormatBytes(tracked, sizeof(tracked), editorMemTracked());
+        editorFormatBytes(untracked, sizeof(untracked), editorMemUntracked());
+        editorSetStatusMessage("Mem: %s text resident | %s tracked %s other | %.1f B/line",
+                               text, tracked, untracked, editorMemOverheadPerLine());
+    }
+    page = (page + 1) % 4;
 }
 
 void editorProcessKeypress() {
     static int quitTimes = kQuitTimes;
     
     int c = editorReadKey();
+    if(EditorConfig.followFd != -1 && editorKeyEdits(c)){
+        editorSetStatusMessage("Read-only while following, Ctrl-W to stop");
+        return;
+    }
+    if(c != CTRL_KEY('n'))
+        WordIndex.cycling = 0;
+    if(editorMultiCursorKey(c)){
+        quitTimes = kQuitTimes;
+        return;
+    }
     switch (c) {
         case '\r':
             editorInsertNewLine();
             break;
         
         case CTRL_KEY('q'):
+            editorWaitSave();
             if(EditorConfig.dirtyFlag && quitTimes > 0){
                 editorSetStatusMessage("WARNING! File has unsaved changes. Press Ctrl-Q %d more times to quit.", quitTimes);
                 quitTimes--;
                 return;
             }
+            // Crawls would otherwise run to the end of the tree
+            editorCrawlCancel(&FileIndex.crawl);
+            editorCrawlCancel(&ProjectSearch.crawl);
+            editorWaitTasks();
+            editorJournalClose(0);
             write(STDOUT_FILENO, "\x1b[2J", 4);
             write(STDOUT_FILENO, "\x1b[H", 3);
             exit(0);
@@ -866,6 +6412,51 @@ void editorProcessKeypress() {
             editorFind();
             break;
             
+        case CTRL_KEY('r'):
+            editorReplace();
+            break;
+            
+        case CTRL_KEY('d'):
+            editorAddCursorBelow();
+            break;
+            
+        case CTRL_KEY('b'):
+            editorToggleBlock();
+            break;
+            
+        case CTRL_KEY('t'):
+            editorShowStats();
+            break;
+            
+        case CTRL_KEY('w'):
+            editorToggleFollow();
+            break;
+            
+        case CTRL_KEY('g'):
+            editorProjectSearch();
+            break;
+            
+        case CTRL_KEY('o'):
+            editorOpenFile();
+            break;
+            
+        case CTRL_KEY(']'):
+            editorMatchBracket();
+            break;
+            
+        case CTRL_KEY('u'):
+        case CTRL_KEY('e'):
+            editorBlockJump(c == CTRL_KEY('e'));
+            break;
+            
+        case CTRL_KEY('k'):
+            editorToggleFold();
+            break;
+            
+        case CTRL_KEY('n'):
+            editorComplete();
+            break;
+            
         case BACKSPACE:
         case CTRL_KEY('h'):
         case DEL_KEY:
@@ -897,12 +6488,16 @@ void editorProcessKeypress() {
             editorMoveCursor(c);
             break;
             
-        case CTRL_KEY('l'):
         case '\x1b':
+            editorClearCursors();
+            break;
+            
+        case CTRL_KEY('l'):
             break;
             
         default:
             editorInsertChar(c);
+            editorCompleteHint();
             break;
     }
     
@@ -913,13 +6508,26 @@ void editorProcessKeypress() {
 
 void editorScroll(){
     EditorConfig.renderX = 0;
-    if(EditorConfig.cursorY < EditorConfig.numRows)
+    if(EditorConfig.cursorY < EditorConfig.numRows){
+        editorRowLoad(&EditorConfig.rows[EditorConfig.cursorY]);
         EditorConfig.renderX = editorRowCursorToRender(&EditorConfig.rows[EditorConfig.cursorY], EditorConfig.cursorX);
+    }
+    
+    // A cursor moved into a fold, as by a search, opens it
+    int fold = editorFoldAt(EditorConfig.cursorY);
+    if(fold != -1)
+        editorFoldRemove(fold);
+    fold = editorFoldAt(EditorConfig.rowOffset);
+    if(fold != -1)
+        EditorConfig.rowOffset = EditorConfig.folds[fold].start;
     
     if(EditorConfig.cursorY < EditorConfig.rowOffset)
         EditorConfig.rowOffset = EditorConfig.cursorY;
-    if(EditorConfig.cursorY >= EditorConfig.rowOffset + EditorConfig.screenRows)
-        EditorConfig.rowOffset = EditorConfig.cursorY - EditorConfig.screenRows + 1;;
+    if(editorVisibleLines(EditorConfig.rowOffset, EditorConfig.cursorY, EditorConfig.screenRows) >= EditorConfig.screenRows){
+        EditorConfig.rowOffset = EditorConfig.cursorY;
+        for(int lines = 1; lines < EditorConfig.screenRows && EditorConfig.rowOffset > 0; lines++)
+            EditorConfig.rowOffset = editorPrevVisibleRow(EditorConfig.rowOffset);
+    }
     
     if(EditorConfig.renderX < EditorConfig.colOffset)
         EditorConfig.colOffset = EditorConfig.renderX;
@@ -944,9 +6552,139 @@ void editorDrawWelcome(AppendBuffer *ab){
     abAppend(ab, welcome, welcomelen);
 }
 
+// Draws render[*j, end) in the color of hl, clipped to the visible columns
+void editorDrawSegment(AppendBuffer *ab, editorRow *row, int *j, int end, int hl, int *renderX, int *currentColor){
+    char *c = row->render;
+    int endX = EditorConfig.colOffset + EditorConfig.screenCols;
+    int color = (hl == HL_NORMAL) ? -1 : editorSyntaxToColor(hl);
+    int pending = *j; // Printable bytes not yet appended start here
+    
+    while(*j < end && *renderX < endX){
+        int cp;
+        int n = utf8Decode(&c[*j], row->renderLength - *j, &cp);
+        int width = (cp < 0) ? 1 : editorCharWidth(cp);
+        if(*renderX < EditorConfig.colOffset || (width == 0 && *renderX == EditorConfig.colOffset)){
+            // Wide char cut by the left edge
+            for(int x = EditorConfig.colOffset; x < *renderX + width; x++)
+                abAppend(ab, " ", 1);
+            *renderX += width;
+            *j += n;
+            pending = *j;
+            continue;
+        }
+        if(*renderX + width > endX)
+            break;
+        
+        if(color != *currentColor){
+            if(*currentColor == 7)
+                abAppend(ab, "\x1b[27m", 5);
+            if(color == -1)
+                abAppend(ab, "\x1b[39m", 5);
+            else{
+                char buf[16];
+                int cLen = snprintf(buf, sizeof(buf), "\x1b[1;%dm", color);
+                abAppend(ab, buf, cLen);
+            }
+            *currentColor = color;
+        }
+        
+        if(cp < 0 || cp < 32 || cp == 127 || (cp >= 0x80 && cp < 0xA0)){
+            abAppend(ab, &c[pending], *j - pending);
+            char sym = (cp >= 0 && cp <= 26) ? '@' + cp : '?';
+            abAppend(ab, "\x1b[7m", 4);
+            abAppend(ab, &sym, 1);
+            abAppend(ab, "\x1b[m", 3);
+            if(*currentColor != -1){
+                char buf[16];
+                int cLength = snprintf(buf, sizeof(buf), "\x1b[%dm", *currentColor);
+                abAppend(ab, buf, cLength);
+            }
+            width = 1;
+            pending = *j + n;
+        }
+        *renderX += width;
+        *j += n;
+    }
+    abAppend(ab, &c[pending], *j - pending);
+}
+
+typedef struct editorOverlay {
+    int start; // Byte offsets in the render window
+    int end;
+    int hl;
+} editorOverlay;
+
+// Collects the search match, block selection and extra cursors drawn over row
+int editorRowOverlays(editorRow *row, editorOverlay *overlays){
+    int count = 0;
+    if(row->index == EditorConfig.searchMatchRow){
+        overlays[count].start = editorRowRenderIndex(row, EditorConfig.searchMatchX);
+        overlays[count].end = editorRowRenderIndex(row, EditorConfig.searchMatchX + EditorConfig.searchMatchLength);
+        overlays[count++].hl = HL_MATCH;
+    }
+    
+    int from = -1;
+    int to = -1;
+    if(EditorConfig.blockActive){
+        int top, bottom, left, right;
+        editorBlockRect(&top, &bottom, &left, &right);
+        if(row->index >= top && row->index <= bottom){
+            from = editorRowRenderToCursor(row, left);
+            to = editorRowRenderToCursor(row, right);
+            if(from == to && row->index != EditorConfig.cursorY)
+                to = utf8NextChar(row->chars, row->size, from);
+            else if(from == to)
+                from = -1;
+        }
+    }
+    for(int i = 0; i < EditorConfig.numCursors; i++){
+        if(EditorConfig.cursors[i].y == row->index){
+            from = EditorConfig.cursors[i].x;
+            to = utf8NextChar(row->chars, row->size, from);
+        }
+    }
+    if(from != -1){
+        overlays[count].start = editorRowRenderIndex(row, from);
+        overlays[count].end = (to > from) ? editorRowRenderIndex(row, to) : overlays[count].start + 1;
+        overlays[count++].hl = HL_SELECTION;
+    }
+    return count;
+}
+
+// Draws the list in place of the rows, the selected line in reverse video
+void editorDrawList(AppendBuffer *ab){
+    if(EditorConfig.listSelected < EditorConfig.listOffset)
+        EditorConfig.listOffset = EditorConfig.listSelected;
+    if(EditorConfig.listSelected >= EditorConfig.listOffset + EditorConfig.screenRows)
+        EditorConfig.listOffset = EditorConfig.listSelected - EditorConfig.screenRows + 1;
+    
+    for(int y = 0; y < EditorConfig.screenRows; y++){
+        int index = y + EditorConfig.listOffset;
+        if(index < EditorConfig.listCount){
+            char line[512];
+            int len = EditorConfig.listLine(index, line, sizeof(line));
+            if(len > EditorConfig.screenCols)
+                len = utf8PrevChar(line, EditorConfig.screenCols + 1);
+            if(index == EditorConfig.listSelected)
+                abAppend(ab, "\x1b[7m", 4);
+            abAppend(ab, line, len);
+            if(index == EditorConfig.listSelected)
+                abAppend(ab, "\x1b[27m", 5);
+        }
+        else
+            abAppend(ab, "~", 1);
+        abAppend(ab, "\x1b[K", 3);
+        abAppend(ab, "\r\n", 2);
+    }
+}
+
 void editorDrawRows(AppendBuffer *ab){
-    for (int y = 0; y < EditorConfig.screenRows; y++){
-        int currentRow = y + EditorConfig.rowOffset;
+    if(EditorConfig.listActive){
+        editorDrawList(ab);
+        return;
+    }
+    int currentRow = EditorConfig.rowOffset;
+    for (int y = 0; y < EditorConfig.screenRows; y++, currentRow = editorNextVisibleRow(currentRow)){
         if(currentRow >= EditorConfig.numRows){
             if (EditorConfig.numRows == 0 && y == EditorConfig.screenRows / 3)
                 editorDrawWelcome(ab);
@@ -954,43 +6692,60 @@ void editorDrawRows(AppendBuffer *ab){
                 abAppend(ab, "~", 1);
         }
         else{
-            int len = EditorConfig.rows[currentRow].renderSize - EditorConfig.colOffset;
-            if(len < 0)
-                len = 0;
-            if(len > EditorConfig.screenCols)
-                len = EditorConfig.screenCols;
-            char *c = &EditorConfig.rows[currentRow].render[EditorConfig.colOffset];
-            unsigned char *hl = &EditorConfig.rows[currentRow].highlighting[EditorConfig.colOffset];
+            editorRow *row = &EditorConfig.rows[currentRow];
+            editorRowLoad(row);
+            editorRowEnsureHighlight(row);
+            editorRowRenderWindow(row, EditorConfig.colOffset, EditorConfig.screenCols);
+            
+            editorOverlay overlays[2];
+            int numOverlays = editorRowOverlays(row, overlays);
+            
+            int renderX = row->renderStart;
+            int endX = EditorConfig.colOffset + EditorConfig.screenCols;
             int currentColor = -1;
-            for(int j = 0; j < len; j++){
-                if(iscntrl((unsigned char)c[j])){
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    abAppend(ab, "\x1b[7m", 4);
-                    abAppend(ab, &sym, 1);
-                    abAppend(ab, "\x1b[m", 3);
-                    if(currentColor != -1){
-                        char buf[16];
-                        int cLength = snprintf(buf, sizeof(buf), "\x1b[%dm", currentColor);
-                        abAppend(ab, buf, cLength);
-                    }
-                }
-                else if(hl[j] == HL_NORMAL){
-                    if(currentColor != -1){
-                        abAppend(ab, "\x1b[39m", 5);
-                        currentColor = -1;
-                    }
-                    abAppend(ab, &c[j], 1);
-                }
-                else{
-                    int color = editorSyntaxToColor(hl[j]);
-                    if(color != currentColor){
-                        currentColor = color;
-                        char buf[16];
-                        int cLen = snprintf(buf, sizeof(buf), "\x1b[1;%dm", color);
-                        abAppend(ab, buf, cLen);
+            int j = 0;
+            for(int r = 0; r < row->numHlRuns && renderX < endX; r++){
+                int runEnd = row->hlRuns[r].start + row->hlRuns[r].length;
+                while(j < runEnd && renderX < endX){
+                    // Overlays split runs they overlap; earlier ones win
+                    int end = runEnd;
+                    int hl = row->hlRuns[r].hl;
+                    int covered = 0;
+                    for(int o = 0; o < numOverlays; o++){
+                        if(!covered && j >= overlays[o].start && j < overlays[o].end){
+                            hl = overlays[o].hl;
+                            covered = 1;
+                            if(end > overlays[o].end)
+                                end = overlays[o].end;
+                        }
+                        else if(overlays[o].start > j && overlays[o].start < end)
+                            end = overlays[o].start;
                     }
-                    abAppend(ab, &c[j], 1);
+                    int before = j;
+                    editorDrawSegment(ab, row, &j, end, hl, &renderX, &currentColor);
+                    if(j == before)
+                        break;
                 }
+                if(j < runEnd)
+                    break;
+            }
+            if(currentColor == 7)
+                abAppend(ab, "\x1b[27m", 5);
+            // A cursor past the end of the row is drawn on a blank cell
+            for(int o = 0; o < numOverlays; o++)
+                if(overlays[o].start >= row->renderLength && overlays[o].hl == HL_SELECTION &&
+                   renderX == row->renderSize && renderX >= EditorConfig.colOffset && renderX < endX)
+                    abAppend(ab, "\x1b[7m \x1b[27m", 10);
+            // A folded row ends with the number of rows it hides
+            int fold = editorFoldAt(currentRow + 1);
+            if(fold != -1 && renderX >= EditorConfig.colOffset){
+                char marker[32];
+                int len = snprintf(marker, sizeof(marker), " +%d lines ", EditorConfig.folds[fold].end - currentRow - 1);
+                if(len > endX - renderX)
+                    len = endX - renderX;
+                abAppend(ab, "\x1b[7m", 4);
+                abAppend(ab, marker, len);
+                abAppend(ab, "\x1b[27m", 5);
             }
             abAppend(ab, "\x1b[39m", 5); // '39m' = Reset colors
         }
@@ -1006,7 +6761,7 @@ void editorDrawStatusBar(AppendBuffer *ab){
     char status[80];
     int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", 
                     EditorConfig.filename ? EditorConfig.filename : "[No Name]", 
-                    EditorConfig.numRows, EditorConfig.dirtyFlag ? "(modified)" : "");
+                    EditorConfig.numRows, EditorConfig.dirtyFlag ? "(modified)" : (EditorConfig.followFd != -1 ? "(following)" : ""));
     char rightStatus[80];
     int rightLen = snprintf(rightStatus, sizeof(rightStatus), "%s | %d/%d ",
                     EditorConfig.syntax ? EditorConfig.syntax->fileType : "No FT",
@@ -1039,7 +6794,9 @@ void editorDrawMessageBar(AppendBuffer *ab){
 }
 
 void editorRefreshScreen(){
+    long long start = editorNow();
     editorScroll();
+    editorPageTrim(); // Keeps the rows about to be drawn
     
     AppendBuffer ab = ABUF_INIT;
     
@@ -1052,15 +6809,26 @@ void editorRefreshScreen(){
     editorDrawMessageBar(&ab);
     
     char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH"
-            , (EditorConfig.cursorY - EditorConfig.rowOffset) + 1
-            , (EditorConfig.renderX - EditorConfig.colOffset) + 1);
+    if(EditorConfig.listActive)
+        snprintf(buf, sizeof(buf), "\x1b[%d;1H", (EditorConfig.listSelected - EditorConfig.listOffset) + 1);
+    else
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH"
+                , editorVisibleLines(EditorConfig.rowOffset, EditorConfig.cursorY, EditorConfig.screenRows) + 1
+                , (EditorConfig.renderX - EditorConfig.colOffset) + 1);
     abAppend(&ab, buf, strlen(buf));
     
     abAppend(&ab, "\x1b[?25h", 6); // '?25h' = Show Cursor
     
     write(STDOUT_FILENO, ab.b, ab.len);
     abFree(&ab);
+    
+    EditorEvents.lastFrame = editorNow();
+    EditorEvents.paintMs = EditorEvents.lastFrame - start;
+    EditorEvents.framesPainted++;
+    if(EditorEvents.keysSinceFrame > 1)
+        EditorEvents.framesSkipped += EditorEvents.keysSinceFrame - 1;
+    EditorEvents.keysSinceFrame = 0;
+    EditorEvents.redraw = 0;
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -1069,11 +6837,20 @@ void editorSetStatusMessage(const char *fmt, ...) {
     vsnprintf(EditorConfig.statusMsg, sizeof(EditorConfig.statusMsg), fmt, ap);
     va_end(ap);
     EditorConfig.statusMsgTime = time(NULL);
+    editorTimerSchedule(&EditorConfig.statusMsgTimer, kStatusMsgMs);
+}
+
+// The message bar hides expired messages on the next redraw
+void editorStatusMessageExpired(){
+    EditorEvents.redraw = 1;
 }
 
 ///// INIT /////
 
 void initEditor(){
+    editorInitWidthTable();
+    editorLoadSyntax();
+    
     EditorConfig.cursorX = 0;
     EditorConfig.cursorY = 0;
     EditorConfig.renderX = 0;
@@ -1081,11 +6858,49 @@ void initEditor(){
     EditorConfig.colOffset = 0;
     EditorConfig.numRows = 0;
     EditorConfig.rows = NULL;
+    EditorConfig.rowsCapacity = 0;
     EditorConfig.dirtyFlag = 0;
+    EditorConfig.version = 0;
+    EditorConfig.snapshot = NULL;
     EditorConfig.filename = NULL;
+    EditorConfig.fileTrailingNewline = 1;
+    EditorConfig.fileSize = 0;
+    EditorConfig.watchFd = -1;
+    EditorConfig.watchWd = -1;
+    EditorConfig.journalFd = -1;
+    EditorConfig.journalPaused = 0;
+    EditorConfig.journalBuffer = NULL;
+    EditorConfig.journalLength = 0;
+    EditorConfig.journalCapacity = 0;
+    EditorConfig.journalTimer.callback = editorJournalFlush;
+    EditorConfig.journalTimer.pending = 0;
+    EditorConfig.journalFailed = 0;
+    EditorConfig.saving = 0;
+    EditorConfig.headless = 0;
+    EditorConfig.followFd = -1;
+    EditorConfig.followTimer.callback = editorFollowTimer;
+    EditorConfig.followTimer.pending = 0;
+    EditorConfig.searchMatchRow = -1;
+    EditorConfig.cursors = NULL;
+    EditorConfig.numCursors = 0;
+    EditorConfig.blockActive = 0;
+    EditorConfig.listActive = 0;
+    EditorConfig.folds = NULL;
+    EditorConfig.numFolds = 0;
     EditorConfig.statusMsg[0] = '\0';
+    EditorConfig.statusMsgTimer.callback = editorStatusMessageExpired;
+    EditorConfig.statusMsgTimer.pending = 0;
     EditorConfig.statusMsgTime = 0;
     EditorConfig.syntax = NULL;
+    Paging.sourceFd = -1; // The budget comes from the command line
+    Paging.spillFd = -1;
+    
+    editorInitProjectSearch();
+    editorInitFileIndex();
+}
+
+void initTerminal(){
+    editorInitEvents();
     
     if (getWindowSize(&EditorConfig.screenRows, &EditorConfig.screenCols) == -1)
         die("getWindowSize");
@@ -1093,17 +6908,60 @@ void initEditor(){
     EditorConfig.screenRows -= 2; // Status
 }
 
+// Prints the memory held by each subsystem once fileName is loaded
+int editorMemReport(const char *fileName){
+    initEditor();
+    EditorConfig.headless = 1;
+    editorOpen((char *)fileName);
+    
+    size_t text = 0;
+    for(int j = 0; j < EditorConfig.numRows; j++)
+        text += EditorConfig.rows[j].size;
+    printf("%s: %d lines, %zu bytes of text, %zu resident\n\n", fileName, EditorConfig.numRows, text, editorMemResidentText());
+    printf("%-16s %14s %10s %14s\n", "subsystem", "bytes", "blocks", "peak");
+    for(int k = 0; k < MEM_KINDS; k++)
+        printf("%-16s %14zu %10ld %14zu\n", kMemKindNames[k], EditorMemory.bytes[k], EditorMemory.blocks[k], EditorMemory.peak[k]);
+    printf("%-16s %14zu\n", "tracked", editorMemTracked());
+    printf("%-16s %14zu\n", "other heap", editorMemUntracked());
+    printf("\noverhead per line: %.1f bytes\n", editorMemOverheadPerLine());
+    if(Paging.budget)
+        printf("paging: %zu budget, %lld faults, %lld evictions, %lld bytes spilled\n",
+               Paging.budget, Paging.faults, Paging.evictions, (long long)Paging.spillSize);
+    return 0;
+}
+
 int main(int argc, char *argv[]){
+    if(argc >= 3 && !strcmp(argv[1], "--mem-budget")){
+        Paging.budget = (size_t)strtoull(argv[2], NULL, 10) << 20; // Megabytes
+        argc -= 2;
+        argv += 2;
+    }
+    if(argc >= 3 && !strcmp(argv[1], "--mem-report"))
+        return editorMemReport(argv[2]);
+    
     enableRawMode();
     initEditor();
-    if(argc >= 2)
+    initTerminal();
+    if(argc >= 3 && !strcmp(argv[1], "--follow")){
+        editorOpen(argv[2]);
+        editorFollowStart();
+    }
+    else if(argc >= 2)
         editorOpen(argv[1]);
     
-    editorSetStatusMessage("HELP: Ctrl-Q → Quit | Ctrl-S → Save | Ctrl-F → Find");
+    if(EditorConfig.statusMsg[0] == '\0')
+        editorSetStatusMessage("HELP: Ctrl-Q → Quit | Ctrl-S → Save | Ctrl-F → Find | Ctrl-R → Replace");
     
+    editorRefreshScreen();
     while(1){
-        editorRefreshScreen();
-        editorProcessKeypress();
+        // Keys already queued are all handled before the next paint
+        do{
+            editorProcessKeypress();
+            editorScroll(); // Page keys depend on the offsets a paint would set
+            EditorEvents.keysProcessed++;
+            EditorEvents.keysSinceFrame++;
+        } while(editorInputPending());
+        editorRequestFrame();
     }
     
     return 0;
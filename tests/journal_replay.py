@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+# Checks the crash journal: a crafted journal replayed against a line longer
+# than 2^23 bytes lands at the recorded column, a journal too short to hold a
+# header is started over, and records that fail to reach the disk are kept
+# and written once there is room again.
+import fcntl, os, pty, resource, select, signal, struct, subprocess, sys, tempfile, termios, time
+
+EDITOR = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else './kbeditor')
+LINE = 9000000
+COLUMN = LINE - 2
+
+def varint(value):
+    out = bytearray()
+    while True:
+        byte = value & 0x7F
+        value >>= 7
+        out.append(byte | (0x80 if value else 0))
+        if not value:
+            return bytes(out)
+
+def header(path):
+    st = os.stat(path)
+    return b'KBJ2' + varint(st.st_size) + varint(st.st_mtime_ns // 10**9) + varint(st.st_mtime_ns % 10**9)
+
+def pump(fd, seconds):
+    output = b''
+    end = time.time() + seconds
+    while time.time() < end:
+        if select.select([fd], [], [], 0.05)[0]:
+            try:
+                output += os.read(fd, 1 << 20)
+            except OSError:
+                break
+    return output
+
+def start(path, preexec_fn=None):
+    master, slave = pty.openpty()
+    fcntl.ioctl(slave, termios.TIOCSWINSZ, struct.pack('HHHH', 24, 80, 0, 0))
+    editor = subprocess.Popen([EDITOR, path], stdin=slave, stdout=slave, stderr=slave, cwd=os.path.dirname(path),
+                              start_new_session=True, preexec_fn=preexec_fn)
+    os.close(slave)
+    return editor, master
+
+def stop(editor, master):
+    editor.kill()
+    editor.wait()
+    os.close(master)
+
+def save(path):
+    size = os.stat(path).st_size
+    editor, master = start(path)
+    pump(master, 1.0)
+    os.write(master, b'\x13')  # Ctrl-S
+    for _ in range(100):
+        pump(master, 0.1)
+        if os.stat(path).st_size != size:
+            break
+    pump(master, 0.3)
+    stop(editor, master)
+    with open(path, 'rb') as f:
+        return f.read()
+
+def fail(message):
+    print('FAIL: ' + message)
+    sys.exit(1)
+
+def long_line(tmp):
+    path = os.path.join(tmp, 'long.txt')
+    with open(path, 'wb') as f:
+        f.write(b'a' * LINE + b'\n')
+    journal = header(path)
+    journal += varint(3) + varint(0) + varint(COLUMN) + varint(ord('X'))  # JOURNAL_INSERT_CHAR
+    journal += varint(3) + varint(5) + varint(0) + varint(ord('Y'))       # Row out of range
+    with open(os.path.join(tmp, '.long.txt.kbswp'), 'wb') as f:
+        f.write(journal)
+
+    data = save(path)
+    expected = b'a' * COLUMN + b'X' + b'a' * (LINE - COLUMN) + b'\n'
+    if data != expected:
+        fail('recovered char at %d, expected %d (size %d)' % (data.find(b'X'), COLUMN, len(data)))
+
+def short_journal(tmp):
+    path = os.path.join(tmp, 'short.txt')
+    with open(path, 'wb') as f:
+        f.write(b'hello\n')
+    journal = os.path.join(tmp, '.short.txt.kbswp')
+    with open(journal, 'wb') as f:
+        f.write(b'KB')
+
+    editor, master = start(path)
+    output = pump(master, 1.0)
+    stop(editor, master)
+    with open(journal, 'rb') as f:
+        data = f.read()
+    if data != header(path) or b'damaged' in output or os.path.exists(journal + '.stale'):
+        fail('short journal was not started over: %r' % data)
+
+def failed_flush(tmp):
+    path = os.path.join(tmp, 'full.txt')
+    with open(path, 'wb') as f:
+        f.write(b'hello\n')
+    limit = len(header(path))
+
+    # Files may grow only as far as the journal header, so the records typed
+    # next can't be written until the limit is lifted
+    def limit_files():
+        signal.signal(signal.SIGXFSZ, signal.SIG_IGN)
+        resource.setrlimit(resource.RLIMIT_FSIZE, (limit, resource.RLIM_INFINITY))
+
+    editor, master = start(path, limit_files)
+    pump(master, 1.0)
+    os.write(master, b'abc')
+    output = pump(master, 1.5)
+    if b"Can't write journal" not in output:
+        stop(editor, master)
+        fail('failed journal write was not reported')
+    resource.prlimit(editor.pid, resource.RLIMIT_FSIZE, (resource.RLIM_INFINITY, resource.RLIM_INFINITY))
+    pump(master, 2.0)
+    stop(editor, master)
+
+    data = save(path)
+    if data != b'abchello\n':
+        fail('edits kept after a failed journal write were lost: %r' % data)
+
+with tempfile.TemporaryDirectory() as tmp:
+    long_line(tmp)
+    short_journal(tmp)
+    failed_flush(tmp)
+    print('PASS')